@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,35 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Each buffer lives on the hash chain of exactly one bucket,
+// normally the one its (dev, blockno) hashes to. A bucket also
+// keeps all of its buffers on an LRU list, which a cache miss
+// scans from the least recently used end for an unreferenced
+// victim, giving buffers used since the last scan a second
+// chance (CLOCK). If the missing block's own bucket has no
+// victim, a clock hand sweeps over the other buckets.
+//
+// A cache hit takes no lock. Writers, which hold the bucket
+// lock, make a bucket's sequence count odd while they change
+// its chain or the identity of one of its buffers. bget()
+// reads the count, walks the chain, takes a reference with
+// compare-and-swap, and keeps it only if the count hasn't
+// changed; otherwise it drops the reference and retries with
+// the lock held. refcnt is only changed atomically. A buffer
+// being recycled has BCLAIM set in refcnt, which keeps
+// lock-free readers from taking a reference to it.
+//
+// The cache starts with NBUF buffers and grows, a page of
+// buffer data at a time, while plenty of memory is free, up to
+// NBUFMAX buffers. When kalloc() runs out of memory it calls
+// breclaim() to give back pages of unreferenced buffers. The
+// hash table doubles its number of buckets as the cache grows.
+//
+// Blocks are hashed with Fibonacci hashing: (dev, blockno) is
+// multiplied by 2^64/phi and the top bits select the bucket, so
+// consecutive block numbers spread over the whole table and no
+// division is needed.
 
 
 #include "types.h"
@@ -23,165 +52,550 @@
 #include "fs.h"
 #include "buf.h"
 
+#define NBUCKETMAX 256   // must be a power of two
+#define HASH(dev, blockno, n) \
+  (((((uint64)(dev) << 32) | (blockno)) * 0x9E3779B97F4A7C15ULL) >> (64 - (n)))
 
+#define BPP (PGSIZE / BSIZE)   // buffers per page of data
 
-/*struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
-
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
-} bcache;*/
+// grow the cache only while this many pages are free.
+#define BHEADROOM 1024
 
-#define NBUCKET 13
-#define HASH(dev, blockno) (dev + blockno) % NBUCKET
+// set in refcnt while a buffer is being recycled or has no data.
+#define BCLAIM 0x80000000
 
-struct hashbuf {
-  struct buf head;       // 头节点
-  struct spinlock lock;  // 锁
+struct bucket {
+  struct spinlock lock;  // protects everything below
+  uint seq;              // odd while the chain is being changed
+  struct buf head;       // hash chain, through prev/next
+  struct buf lruhead;    // all of the chain's buffers, through lprev/lnext.
+                         // lruhead.lnext is most recently used.
+  int len;               // length of hash chain
+  uint hits;             // bget() found the block here, with the lock held
+  uint misses;           // bget() didn't
+  char lockname[12];
 };
 
-char lockname[NBUCKET];
+// lock-free hits, counted per CPU; padded so that
+// CPUs don't share a cache line.
+struct cpuhits {
+  uint n;
+  char pad[60];
+};
 
+// Lock order: growlock, then bucket locks in index order.
+// Code holding a bucket lock never waits for another lock.
 struct {
-  struct spinlock lock; // 保留大锁以备调试
-  struct buf buf[NBUF];
-  struct hashbuf buckets[NBUCKET];  // 散列桶
+  struct spinlock growlock;  // serializes bgrow, breclaim and bresize
+  struct buf buf[NBUFMAX];   // buf[g*BPP..] share one page of data
+  int nbuf;                  // buffers with data
+  int min;                   // breclaim() keeps at least this many
+  struct bucket bucket[NBUCKETMAX];
+  uint nbucket;              // buckets in use, a power of two
+  uint shift;                // log2(nbucket); changes only with all locks held
+  uint hand;                 // clock hand over bucket[] for stealing victims
+  struct cpuhits fasthits[NCPU];
+  uint raissued;             // blocks read by breadahead()
+  uint rahits;               // of which bread() later asked for
 } bcache;
 
-void
-binit(void)
+// Bracket a change to bk's chain, or to the identity of one
+// of its buffers, for lock-free readers. Caller holds bk->lock.
+static void
+write_begin(struct bucket *bk)
+{
+  bk->seq++;
+  __sync_synchronize();
+}
+
+static void
+write_end(struct bucket *bk)
+{
+  __sync_synchronize();
+  bk->seq++;
+}
+
+// Insert b at the front of bk's hash chain, and at the
+// most recently used end of its LRU list.
+static void
+chain_insert(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+  bk->len++;
+  b->bucket = bk - bcache.bucket;
+
+  b->lnext = bk->lruhead.lnext;
+  b->lprev = &bk->lruhead;
+  bk->lruhead.lnext->lprev = b;
+  bk->lruhead.lnext = b;
+}
+
+// Unlink b from its chain. b->next is left alone, so a
+// lock-free reader standing on b can still find its way
+// back to a bucket head.
+static void
+chain_remove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  bcache.bucket[b->bucket].len--;
+  b->bucket = -1;
+
+  b->lnext->lprev = b->lprev;
+  b->lprev->lnext = b->lnext;
+}
+
+// Claim the least recently used unreferenced buffer of bk,
+// passing over (and clearing) the referenced bit of buffers
+// used since the last scan. Returns the buffer with BCLAIM
+// set in refcnt, or 0. Caller must hold bk->lock.
+static struct buf*
+lru_claim(struct bucket *bk)
 {
   struct buf *b;
+  int i;
 
-  initlock(&bcache.lock, "bcache");
-  for(int i = 0; i < NBUCKET; ++i) {
-    // 初始化散列桶的自旋锁
-    snprintf(lockname, sizeof(lockname), "bcache_%d", i);
-    initlock(&bcache.buckets[i].lock, lockname);
+  for(i = 0; i < 2*bk->len; i++){
+    b = bk->lruhead.lprev;
+    // move it to the most recently used end.
+    b->lnext->lprev = b->lprev;
+    b->lprev->lnext = b->lnext;
+    b->lnext = bk->lruhead.lnext;
+    b->lprev = &bk->lruhead;
+    bk->lruhead.lnext->lprev = b;
+    bk->lruhead.lnext = b;
+    if(b->referenced){
+      b->referenced = 0;
+      continue;
+    }
+    if(__sync_bool_compare_and_swap(&b->refcnt, 0, BCLAIM))
+      return b;
+  }
+  return 0;
+}
 
-    // 初始化散列桶的头节点
-    bcache.buckets[i].head.prev = &bcache.buckets[i].head;
-    bcache.buckets[i].head.next = &bcache.buckets[i].head;
+// Lock and return the bucket that (dev, blockno)
+// hashes to, coping with a concurrent bresize().
+static struct bucket*
+bucket_lock(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  uint shift;
+
+  for(;;){
+    shift = bcache.shift;
+    bk = &bcache.bucket[HASH(dev, blockno, shift)];
+    acquire(&bk->lock);
+    if(shift == bcache.shift)
+      return bk;
+    release(&bk->lock);
   }
-  for(b = bcache.buf; b < bcache.buf + NBUF; b++) {
-    // 利用头插法初始化缓冲区列表,全部放到散列桶0上
-    b->next = bcache.buckets[0].head.next;
-    b->prev = &bcache.buckets[0].head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.buckets[0].head.next->prev = b;
-    bcache.buckets[0].head.next = b;
+}
+
+// Rehash every buffer into 2^shift buckets.
+// Caller must hold bcache.growlock.
+static void
+bresize(uint shift)
+{
+  struct bucket *bk;
+  struct buf *b;
+  uint n = 1 << shift;
+
+  for(bk = bcache.bucket; bk < bcache.bucket + n; bk++){
+    acquire(&bk->lock);
+    write_begin(bk);
+  }
+
+  for(bk = bcache.bucket; bk < bcache.bucket + n; bk++){
+    bk->head.prev = bk->head.next = &bk->head;
+    bk->lruhead.lprev = bk->lruhead.lnext = &bk->lruhead;
+    bk->len = 0;
+  }
+  for(b = bcache.buf; b < bcache.buf + NBUFMAX; b++){
+    // skip empty slots, and buffers that bget() has taken
+    // off their bucket and will insert into a new one.
+    if(b->data == 0 || b->bucket < 0)
+      continue;
+    chain_insert(&bcache.bucket[HASH(b->dev, b->blockno, shift)], b);
+  }
+  bcache.nbucket = n;
+  bcache.shift = shift;
+
+  for(bk = bcache.bucket + n - 1; bk >= bcache.bucket; bk--){
+    write_end(bk);
+    release(&bk->lock);
   }
-  // Create linked list of buffers
-  /*bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }*/
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Give the cache another page of buffers. If claim is set,
+// return one of them with refcnt BCLAIM and on no bucket,
+// for bget() to use; the rest go on bucket chains.
+// Returns 0 at NBUFMAX buffers or if out of memory.
 static struct buf*
-bget(uint dev, uint blockno)
+bgrow(int claim)
 {
-  struct buf *b;
+  struct bucket *bk;
+  struct buf *b, *got;
+  char *pa;
+  int g, i;
 
-  int bid = HASH(dev, blockno);
-  acquire(&bcache.buckets[bid].lock);
+  // allocate before taking growlock, since kalloc()
+  // may call breclaim().
+  if((pa = kalloc()) == 0)
+    return 0;
 
-  // Is the block already cached?
-  for(b = bcache.buckets[bid].head.next; b != &bcache.buckets[bid].head; b = b->next) {
-    if(b->dev == dev && b->blockno == blockno) {
-      b->refcnt++;
-      // 记录使用时间戳
-      b->timestamp = ticks;
-      release(&bcache.buckets[bid].lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  acquire(&bcache.growlock);
+  for(g = 0; g < NBUFMAX/BPP; g++)
+    if(bcache.buf[g*BPP].data == 0)
+      break;
+  if(g == NBUFMAX/BPP){
+    release(&bcache.growlock);
+    kfree(pa);
+    return 0;
   }
 
-  // Not cached.
-  b = 0;
-  struct buf* tmp;
-
-  // Recycle the least recently used (LRU) unused buffer.
-  // 从当前散列桶开始查找
-  for(int i = bid, cycle = 0; cycle != NBUCKET; i = (i + 1) % NBUCKET) {
-    ++cycle;
-    // 如果遍历到当前散列桶，则不重新获取锁
-    if(i != bid) {
-      if(!holding(&bcache.buckets[i].lock))
-        acquire(&bcache.buckets[i].lock);
-      else
-        continue;
+  got = 0;
+  for(i = 0; i < BPP; i++){
+    b = &bcache.buf[g*BPP + i];
+    b->data = (uchar*)pa + i*BSIZE;
+    b->dev = 0;
+    b->blockno = 0;
+    b->valid = 0;
+    b->referenced = 0;
+    if(claim && got == 0){
+      got = b;  // refcnt stays BCLAIM
+      continue;
     }
-    for(tmp = bcache.buckets[i].head.next; tmp != &bcache.buckets[i].head; tmp = tmp->next){
-      // 使用时间戳进行LRU算法，而不是根据结点在链表中的位置
-      if(tmp->refcnt == 0 && (b == 0 || tmp->timestamp < b->timestamp))
-        b = tmp;
+    b->refcnt = 0;
+    bk = &bcache.bucket[(g*BPP + i) % bcache.nbucket];
+    acquire(&bk->lock);
+    write_begin(bk);
+    chain_insert(bk, b);
+    write_end(bk);
+    release(&bk->lock);
+  }
+  bcache.nbuf += BPP;
+
+  if(bcache.nbuf > 2*bcache.nbucket && 2*bcache.nbucket <= NBUCKETMAX)
+    bresize(bcache.shift + 1);
+  release(&bcache.growlock);
+  return got;
+}
+
+// Should a miss grow the cache rather than evict?
+static int
+bwantgrow(void)
+{
+  return bcache.nbuf < NBUFMAX && kfreemem() > BHEADROOM;
+}
+
+// Free up to n pages of unreferenced buffers, but keep
+// at least bcache.min buffers. Called by kalloc() when it runs
+// out of memory. Returns the number of pages freed.
+int
+breclaim(int n)
+{
+  struct bucket *bk[BPP];
+  struct buf *b0;
+  int g, i, j, nbk, ok, freed;
+
+  if(bcache.nbuf - BPP < bcache.min)
+    return 0;
+
+  freed = 0;
+  acquire(&bcache.growlock);
+  for(g = 0; g < NBUFMAX/BPP && freed < n && bcache.nbuf - BPP >= bcache.min; g++){
+    b0 = &bcache.buf[g*BPP];
+    if(b0->data == 0)
+      continue;
+
+    // lock the buckets of the page's buffers, in index order.
+    nbk = 0;
+    ok = 1;
+    for(i = 0; i < BPP && ok; i++){
+      struct buf *b = &b0[i];
+      if(b->refcnt != 0 || b->bucket < 0){
+        ok = 0;
+        break;
+      }
+      bk[nbk++] = &bcache.bucket[b->bucket];
     }
-    if(b) {
-      // 如果是从其他散列桶窃取的，则将其以头插法插入到当前桶
-      if(i != bid) {
-        b->next->prev = b->prev;
-        b->prev->next = b->next;
-        release(&bcache.buckets[i].lock);
-
-        b->next = bcache.buckets[bid].head.next;
-        b->prev = &bcache.buckets[bid].head;
-        bcache.buckets[bid].head.next->prev = b;
-        bcache.buckets[bid].head.next = b;
+    if(!ok)
+      continue;
+    for(i = 1; i < nbk; i++)   // insertion sort
+      for(j = i; j > 0 && bk[j-1] > bk[j]; j--){
+        struct bucket *t = bk[j]; bk[j] = bk[j-1]; bk[j-1] = t;
       }
+    for(i = 0; i < nbk; i++)
+      if(i == 0 || bk[i] != bk[i-1])
+        acquire(&bk[i]->lock);
 
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      b->timestamp = ticks;
-      release(&bcache.buckets[bid].lock);
-      acquiresleep(&b->lock);
-      return b;
+    // recheck now that the buffers can't move, and claim
+    // them so that lock-free readers leave them alone.
+    for(i = 0; i < BPP; i++){
+      if(b0[i].bucket < 0)
+        break;
+      for(j = 0; j < nbk && bk[j] != &bcache.bucket[b0[i].bucket]; j++)
+        ;
+      if(j == nbk)
+        break;  // moved to a bucket we didn't lock
+      if(!__sync_bool_compare_and_swap(&b0[i].refcnt, 0, BCLAIM))
+        break;
+    }
+    ok = (i == BPP);
+    if(!ok){
+      while(--i >= 0)
+        b0[i].refcnt = 0;
     } else {
-      // 在当前散列桶中未找到，则直接释放锁
-      if(i != bid)
-        release(&bcache.buckets[i].lock);
+      for(i = 0; i < BPP; i++){
+        struct bucket *bb = &bcache.bucket[b0[i].bucket];
+        write_begin(bb);
+        chain_remove(&b0[i]);
+        write_end(bb);
+        b0[i].valid = 0;
+      }
+    }
+
+    for(i = nbk - 1; i >= 0; i--)
+      if(i == 0 || bk[i] != bk[i-1])
+        release(&bk[i]->lock);
+
+    if(ok){
+      kfree((void*)b0->data);
+      for(i = 0; i < BPP; i++)
+        b0[i].data = 0;  // refcnt stays BCLAIM
+      bcache.nbuf -= BPP;
+      freed++;
+    }
+  }
+  release(&bcache.growlock);
+  return freed;
+}
+
+void
+binit(void)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  initlock(&bcache.growlock, "bcache_grow");
+  for(bk = bcache.bucket; bk < bcache.bucket + NBUCKETMAX; bk++){
+    snprintf(bk->lockname, sizeof(bk->lockname), "bcache_%d", (int)(bk - bcache.bucket));
+    initlock(&bk->lock, bk->lockname);
+    bk->head.prev = bk->head.next = &bk->head;
+    bk->head.bucket = -1;  // never matches in bget_fast()
+    bk->lruhead.lprev = bk->lruhead.lnext = &bk->lruhead;
+  }
+  // about two buffers per bucket.
+  bcache.shift = 1;
+  while((2 << bcache.shift) < NBUF && (2 << bcache.shift) <= NBUCKETMAX)
+    bcache.shift++;
+  bcache.nbucket = 1 << bcache.shift;
+
+  for(b = bcache.buf; b < bcache.buf+NBUFMAX; b++){
+    initsleeplock(&b->lock, "buffer");
+    b->bucket = -1;
+    b->refcnt = BCLAIM;
+  }
+  breserve(NBUF);
+}
+
+// Grow the cache to at least n buffers, and keep that many:
+// the log needs room for the buffers it pins.
+void
+breserve(int n)
+{
+  if(n > NBUFMAX)
+    panic("breserve");
+  if(n > bcache.min)
+    bcache.min = n;
+  while(bcache.nbuf < bcache.min)
+    if(bgrow(0) == 0 && bcache.nbuf < bcache.min)
+      panic("breserve");
+}
+
+// Claim the least recently used unreferenced buffer of
+// any bucket, starting at the clock hand, and take it off
+// its bucket. Returns it with refcnt BCLAIM, or 0.
+static struct buf*
+bsteal(void)
+{
+  struct bucket *bk;
+  struct buf *b;
+  uint n = bcache.nbucket;
+
+  for(int i = 0; i < n; i++){
+    bk = &bcache.bucket[__sync_fetch_and_add(&bcache.hand, 1) % n];
+    if(bk->len == 0)  // racy peek
+      continue;
+    acquire(&bk->lock);
+    if((b = lru_claim(bk)) != 0){
+      write_begin(bk);
+      chain_remove(b);
+      b->dev = 0;      // no block, so it can't shadow
+      b->blockno = 0;  // a valid copy after a bresize()
+      write_end(bk);
     }
+    release(&bk->lock);
+    if(b)
+      return b;
+  }
+  return 0;
+}
+
+// Look up (dev, blockno) without taking a lock, and take
+// a reference to its buffer if it is cached. Returns 0 if
+// it isn't, or if the bucket changed underfoot.
+static struct buf*
+bget_fast(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  struct buf *b;
+  uint shift, seq, r;
+  int n;
+
+  shift = bcache.shift;
+  bk = &bcache.bucket[HASH(dev, blockno, shift)];
+  seq = bk->seq;
+  __sync_synchronize();
+  if(seq & 1)
+    return 0;
+
+  // a concurrent writer can send the walk astray,
+  // so bound it; the sequence check catches the rest.
+  n = 0;
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno && b->bucket >= 0)
+      break;
+    if(++n >= NBUFMAX)
+      return 0;
+  }
+  if(b == &bk->head)
+    return 0;
+
+  do {
+    r = b->refcnt;
+    if(r & BCLAIM)
+      return 0;
+  } while(!__sync_bool_compare_and_swap(&b->refcnt, r, r+1));
+
+  if(bk->seq != seq || bcache.shift != shift ||
+     b->dev != dev || b->blockno != blockno){
+    __sync_fetch_and_sub(&b->refcnt, 1);
+    return 0;
   }
-  panic("bget: no buffers");
-  //acquire(&bcache.lock);
+  return b;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return it referenced but not locked.
+static struct buf*
+bget_ref(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  struct buf *b, *victim;
+
+  if((b = bget_fast(dev, blockno)) != 0){
+    push_off();
+    bcache.fasthits[cpuid()].n++;
+    pop_off();
+    b->referenced = 1;
+    return b;
+  }
+
+  bk = bucket_lock(dev, blockno);
+
   // Is the block already cached?
-  /*for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head.next; b != &bk->head; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      __sync_fetch_and_add(&b->refcnt, 1);
+      b->referenced = 1;
+      bk->hits++;
+      release(&bk->lock);
       return b;
     }
-  }*/
+  }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  /*for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+  bk->misses++;
+  // Recycle the least recently used unused buffer of this
+  // bucket, unless there's room to grow the cache instead.
+  if(!bwantgrow() && (b = lru_claim(bk)) != 0){
+    write_begin(bk);
+    goto found;
+  }
+
+  // Grow the cache, or steal a buffer from another bucket.
+  // Only one bucket lock is held at a time, so two
+  // stealers can't deadlock.
+  release(&bk->lock);
+  victim = 0;
+  if(bwantgrow())
+    victim = bgrow(1);
+  if(victim == 0 && (victim = bsteal()) == 0 && (victim = bgrow(1)) == 0)
+    panic("bget: no buffers");
+  bk = bucket_lock(dev, blockno);
+  victim->valid = 0;
+  victim->referenced = 0;
+
+  // Someone else may have cached the block while
+  // bk->lock was released; if so, keep the victim as
+  // a spare buffer of this bucket.
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      write_begin(bk);
+      chain_insert(bk, victim);
+      write_end(bk);
+      __sync_synchronize();
+      victim->refcnt = 0;
+      __sync_fetch_and_add(&b->refcnt, 1);
+      b->referenced = 1;
+      release(&bk->lock);
       return b;
     }
-  }*/
-  //panic("bget: no buffers");
+  }
+  b = victim;
+  write_begin(bk);
+  chain_insert(bk, b);
+
+found:
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->readahead = 0;
+  b->referenced = 1;
+  write_end(bk);
+  // only now may lock-free readers take references.
+  __sync_synchronize();
+  b->refcnt = 1;
+  release(&bk->lock);
+  return b;
+}
+
+// Like bget_ref(), but return the buffer locked.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget_ref(dev, blockno);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Drop a reference to b. An unreferenced buffer stays on
+// its chain and LRU list, ready for reuse or recycling.
+static void
+bput(struct buf *b)
+{
+  uint r = __sync_fetch_and_sub(&b->refcnt, 1);
+
+  if(r == 0 || (r & BCLAIM))
+    panic("bput");
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -191,6 +605,10 @@ bread(uint dev, uint blockno)
   struct buf *b;
 
   b = bget(dev, blockno);
+  if(b->readahead){
+    b->readahead = 0;
+    __sync_fetch_and_add(&bcache.rahits, 1);
+  }
   if(!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
@@ -198,6 +616,72 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for the indicated block without reading
+// it, for a caller that is going to overwrite all of it.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->readahead = 0;
+  b->valid = 1;
+  return b;
+}
+
+// Start reading blocks that are likely to be wanted soon,
+// skipping any that are cached or busy, as one batch of
+// disk requests. Doesn't wait for the disk. Returns how
+// many of the n <= NREADAHEAD blocks were dealt with,
+// which is fewer than n if the disk queue filled up.
+int
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *b, *bs[NREADAHEAD];
+  int pos[NREADAHEAD];
+  int i, k, sent;
+
+  if(n > NREADAHEAD)
+    panic("breadahead");
+
+  k = 0;
+  for(i = 0; i < n; i++){
+    b = bget_ref(dev, blocknos[i]);
+    if(b->valid || !tryacquiresleep(&b->lock)){
+      bput(b);
+      continue;
+    }
+    if(b->valid){
+      releasesleep(&b->lock);
+      bput(b);
+      continue;
+    }
+    b->readahead = 1;
+    pos[k] = i;
+    bs[k++] = b;
+  }
+
+  sent = virtio_disk_submit(bs, k, 0, breaddone, 1);
+  __sync_fetch_and_add(&bcache.raissued, sent);
+  for(i = sent; i < k; i++){
+    bs[i]->readahead = 0;
+    releasesleep(&bs[i]->lock);
+    bput(bs[i]);
+  }
+  return sent < k ? pos[sent] : n;
+}
+
+// Called by virtio_disk_intr() when a read started by
+// breadahead() finishes. The reference and the lock that
+// breadahead() took are dropped here.
+void
+breaddone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -207,8 +691,24 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write the n locked buffers in bufs[] to disk, handing
+// them to the disk all at once so that it can work on
+// several at a time.
+void
+bwritev(struct buf **bufs, int n)
+{
+  int i, sent;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bwritev");
+  for(sent = 0; sent < n; )
+    sent += virtio_disk_submit(bufs + sent, n - sent, 1, 0, 0);
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bufs[i]);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -216,50 +716,65 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  int bid = HASH(b->dev, b->blockno);
-  acquire(&bcache.buckets[bid].lock);
-  b->refcnt--;
-  // 更新时间戳
-  // 由于LRU改为使用时间戳判定，不再需要头插法
-  if(b->refcnt == 0)
-    b->timestamp = ticks;
-  release(&bcache.buckets[bid].lock);
-  //acquire(&bcache.lock);
-  /*b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }*/
-  
-  //release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  int bid = HASH(b->dev, b->blockno);
-  acquire(&bcache.buckets[bid].lock);
-  b->refcnt++;
-  release(&bcache.buckets[bid].lock);
-  /*acquire(&bcache.lock);
-  b->refcnt++;
-  release(&bcache.lock);*/
+  __sync_fetch_and_add(&b->refcnt, 1);
 }
 
 void
 bunpin(struct buf *b) {
-  int bid = HASH(b->dev, b->blockno);
-  acquire(&bcache.buckets[bid].lock);
-  b->refcnt--;
-  release(&bcache.buckets[bid].lock);
-  /*acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);*/
+  bput(b);
 }
 
+// Print buffer cache statistics for the stats device:
+// totals, the spread of hash chain lengths, and the
+// busiest buckets, to show skew in the hash.
+int
+statsbcache(char *buf, int sz)
+{
+  struct bucket *bk, *top[5];
+  uint hits, fasthits, misses, n;
+  int i, j, minlen, maxlen;
+
+  hits = misses = fasthits = 0;
+  minlen = NBUFMAX;
+  maxlen = 0;
+  for(i = 0; i < 5; i++)
+    top[i] = 0;
 
+  // racy reads; the numbers are only statistics.
+  for(i = 0; i < NCPU; i++)
+    fasthits += bcache.fasthits[i].n;
+  n = bcache.nbucket;
+  for(bk = bcache.bucket; bk < bcache.bucket + n; bk++){
+    hits += bk->hits;
+    misses += bk->misses;
+    if(bk->len < minlen)
+      minlen = bk->len;
+    if(bk->len > maxlen)
+      maxlen = bk->len;
+    for(i = 0; i < 5; i++){
+      if(top[i] == 0 || bk->hits + bk->misses > top[i]->hits + top[i]->misses){
+        for(j = 4; j > i; j--)
+          top[j] = top[j-1];
+        top[i] = bk;
+        break;
+      }
+    }
+  }
+
+  i = snprintf(buf, sz, "--- bcache stats\n");
+  i += snprintf(buf+i, sz-i, "%d buffers, %d buckets, %d hits (%d lock-free), %d misses\n",
+                bcache.nbuf, n, hits + fasthits, fasthits, misses);
+  i += snprintf(buf+i, sz-i, "chain length: min %d max %d\n", minlen, maxlen);
+  i += snprintf(buf+i, sz-i, "busiest buckets (locked lookups):\n");
+  for(j = 0; j < 5 && top[j]; j++)
+    i += snprintf(buf+i, sz-i, "bucket %d: %d hits %d misses chain %d\n",
+                  (int)(top[j] - bcache.bucket), top[j]->hits, top[j]->misses, top[j]->len);
+  i += snprintf(buf+i, sz-i, "read-ahead: %d blocks read, %d used\n",
+                bcache.raissued, bcache.rahits);
+  return i;
+}
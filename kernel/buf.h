@@ -1,13 +1,17 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int readahead; // read by breadahead(), not yet asked for
   uint dev;
   uint blockno;
   struct sleeplock lock;
-  uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint refcnt;      // changed only atomically; see bio.c
+  int referenced;   // used since the last LRU scan
+  int bucket;       // index of bucket whose chain holds it, or -1
+  struct buf *prev; // hash chain
   struct buf *next;
-  uchar data[BSIZE];
-  uint timestamp;
+  struct buf *lprev; // bucket's LRU list
+  struct buf *lnext;
+  uchar *data;      // BSIZE bytes, in a page shared with other bufs
 };
 
@@ -0,0 +1,169 @@
+// Directory name cache.
+//
+// Maps (dev, directory inum, name) to the inum the name refers
+// to and the offset of its entry in the directory, so that
+// dirlookup() needn't read the directory. Misses are cached
+// too, as entries with inum 0, so looking up a name that
+// isn't there, as create() does before every new file, is
+// also fast.
+//
+// Callers hold the directory's inode lock, which keeps the
+// cache consistent with the directory: dirlookup() fills it,
+// dirlink() and sys_unlink() update the name they change,
+// and iput() purges a directory's names when it is freed.
+// namex() also looks names up without the directory lock, and
+// re-checks an answer once it holds a reference to the inode.
+//
+// The cache is set-associative: a name hashes to one set of
+// DWAYS entries, with its own spin-lock, and a miss replaces
+// the least recently used entry of the set.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+
+#define NDSET 64     // must be a power of two
+#define DWAYS 4
+
+struct dentry {
+  uint dev;
+  uint dir;          // inum of the directory; 0 if the entry is unused
+  char name[DIRSIZ];
+  uint inum;         // 0 if the directory has no such name
+  uint off;          // offset of the directory entry
+  uint used;         // when last used, for LRU replacement
+};
+
+struct dset {
+  struct spinlock lock;
+  uint clock;
+  struct dentry e[DWAYS];
+  uint hits;
+  uint misses;
+};
+
+struct {
+  struct dset set[NDSET];
+} dcache;
+
+void
+dcacheinit(void)
+{
+  int i;
+
+  for(i = 0; i < NDSET; i++)
+    initlock(&dcache.set[i].lock, "dcache");
+}
+
+static struct dset*
+dset(uint dev, uint dir, char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261U ^ dev;  // FNV-1a
+  h = (h ^ dir) * 16777619;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return &dcache.set[h & (NDSET-1)];
+}
+
+static struct dentry*
+dfind(struct dset *s, uint dev, uint dir, char *name)
+{
+  struct dentry *e;
+
+  for(e = s->e; e < s->e + DWAYS; e++)
+    if(e->dir == dir && e->dev == dev && strncmp(name, e->name, DIRSIZ) == 0)
+      return e;
+  return 0;
+}
+
+// Look up name in directory dir. Returns 1 and sets *inum and
+// *off if the cache knows the answer; *inum is 0 if there is
+// no such name. Returns 0 if the directory must be read.
+int
+dcache_lookup(uint dev, uint dir, char *name, uint *inum, uint *off)
+{
+  struct dset *s;
+  struct dentry *e;
+
+  s = dset(dev, dir, name);
+  acquire(&s->lock);
+  if((e = dfind(s, dev, dir, name)) == 0){
+    s->misses++;
+    release(&s->lock);
+    return 0;
+  }
+  e->used = ++s->clock;
+  *inum = e->inum;
+  *off = e->off;
+  s->hits++;
+  release(&s->lock);
+  return 1;
+}
+
+// Record that name in directory dir refers to inum, in the
+// entry at offset off, or with inum 0, that there is no
+// such name.
+void
+dcache_enter(uint dev, uint dir, char *name, uint inum, uint off)
+{
+  struct dset *s;
+  struct dentry *e, *victim;
+
+  s = dset(dev, dir, name);
+  acquire(&s->lock);
+  if((e = dfind(s, dev, dir, name)) == 0){
+    victim = s->e;
+    for(e = s->e; e < s->e + DWAYS; e++){
+      if(e->dir == 0){
+        victim = e;
+        break;
+      }
+      if(e->used < victim->used)
+        victim = e;
+    }
+    e = victim;
+    e->dev = dev;
+    e->dir = dir;
+    strncpy(e->name, name, DIRSIZ);
+  }
+  e->inum = inum;
+  e->off = off;
+  e->used = ++s->clock;
+  release(&s->lock);
+}
+
+// Forget every name in directory dir, which is being freed.
+void
+dcache_purge(uint dev, uint dir)
+{
+  struct dset *s;
+  struct dentry *e;
+
+  for(s = dcache.set; s < dcache.set + NDSET; s++){
+    acquire(&s->lock);
+    for(e = s->e; e < s->e + DWAYS; e++)
+      if(e->dir == dir && e->dev == dev)
+        e->dir = 0;
+    release(&s->lock);
+  }
+}
+
+int
+statsdcache(char *buf, int sz)
+{
+  struct dset *s;
+  uint hits, misses;
+
+  hits = misses = 0;
+  for(s = dcache.set; s < dcache.set + NDSET; s++){
+    hits += s->hits;
+    misses += s->misses;
+  }
+  return snprintf(buf, sz, "--- dcache stats\n%d hits, %d misses\n", hits, misses);
+}
@@ -60,6 +60,7 @@ void
 fileclose(struct file *f)
 {
   struct file ff;
+  int n;
 
   acquire(&ftable.lock);
   if(f->ref < 1)
@@ -76,9 +77,19 @@ fileclose(struct file *f)
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    // write the blocks whose allocation writes through this
+    // file delayed, as part of this operation, unless the
+    // file has been unlinked and this iput() may free it.
+    n = ff.type == FD_INODE ? MAXOPBLOCKS + IPUTBLOCKS : MAXOPBLOCKS;
+    begin_opn(n);
+    if(ff.type == FD_INODE && ff.writable){
+      ilock(ff.ip);
+      if(ff.ip->nlink > 0)
+        iflush(ff.ip);
+      iunlock(ff.ip);
+    }
     iput(ff.ip);
-    end_op();
+    end_opn(n);
   }
 }
 
@@ -146,25 +157,31 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write many blocks at a time, but not so many as to
+    // take more than half the maximum log transaction size,
+    // so that a large write needn't wait for a transaction
+    // with no other operations in it. each
+    // transaction reserves log space for the data blocks,
+    // one more for a non-aligned write, the i-node, the
+    // extent block, the doubly-indirect and 2 indirect
+    // blocks, 2 allocation bitmap blocks, and the NDELAY
+    // delayed blocks that writei() may have to flush.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = (LOGSIZE/2-1-1-1-1-2-2-NDELAY) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
+      int nblocks = n1/BSIZE + 1+1+1+1+2+2+NDELAY;
 
-      begin_op();
+      begin_opn(nblocks);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
-      end_op();
+      end_opn(nblocks);
 
       if(r < 0)
         break;
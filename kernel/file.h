@@ -25,15 +25,33 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // hash chain; see fs.c
+  struct inode *lprev; // LRU list of unreferenced inodes
+  struct inode *lnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint raoff;         // offset where the last readi() ended
+  uint rawin;         // read-ahead window, in blocks
+  uint ranext;        // first block not yet read ahead
 
   short type;         // copy of disk inode
-  short major;
+  union {
+    short major;
+    short dirfmt;
+  };
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint xaddr;
+  uint daddr;
+  uint xblocks;
+
+  uint xhbn;          // file block where xhint starts
+  struct extent xhint;  // last extent found in block xaddr
+  uint nextblk;       // where to allocate the next block
+  char *delay;        // delayed blocks, past the extents; see fs.c
+  uint ndelay;
 };
 
 // map major device number to device functions.
@@ -17,6 +17,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
@@ -26,6 +27,10 @@
 // only one device
 struct superblock sb; 
 
+static void bsuminit(int);
+static void isuminit(int);
+static void idiscard(struct inode*);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +49,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
+  isuminit(dev);
 }
 
 // Zero a block.
@@ -59,47 +66,182 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The allocator keeps a summary of the free bitmap in memory:
+// for each bitmap block, the number of free blocks it maps and
+// a bound on its longest run of free blocks. It skips bitmap
+// blocks that can't satisfy a request without reading them,
+// and searches the rest a word at a time. It allocates near a
+// goal, normally the block after the file's last one, and hands
+// out runs of blocks so that files stay contiguous.
+//
+// sum[i] changes only with bitmap block i's buffer locked;
+// searches read it without the lock, as a hint.
+
+static struct {
+  int n;            // number of bitmap blocks
+  uint rotor;       // block after the last allocated run
+  struct bsum {
+    uint nfree;     // free blocks
+    uint maxrun;    // at least as long as the longest free run
+  } sum[NBMAP];
+} bsum;
+
+#define BFREE(map, bi) (((map)[(bi)/32] & (1U << ((bi)%32))) == 0)
+
+// Return the first bit in [from, end) of bitmap block map that
+// starts a run of want free blocks, or -1. *longest is set to
+// the longest run seen.
+static int
+bscan(uint *map, int from, int end, int want, int *longest)
+{
+  int bi, start, run;
+
+  start = run = *longest = 0;
+  for(bi = from; bi < end; ){
+    if(bi % 32 == 0 && bi + 32 <= end && (map[bi/32] == 0xffffffff || map[bi/32] == 0)){
+      // a whole word in use, or free.
+      if(map[bi/32] != 0){
+        run = 0;
+      } else {
+        if(run == 0)
+          start = bi;
+        run += 32;
+      }
+      bi += 32;
+    } else {
+      if(!BFREE(map, bi)){
+        run = 0;
+      } else {
+        if(run == 0)
+          start = bi;
+        run++;
+      }
+      bi++;
+    }
+    if(run > *longest)
+      *longest = run;
+    if(run >= want)
+      return start;
+  }
+  return -1;
+}
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+// Read the bitmap and build its summary.
+static void
+bsuminit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  int i, bi, end, longest;
+
+  bsum.n = (sb.size + BPB - 1) / BPB;
+  if(bsum.n > NBMAP)
+    panic("bsuminit: bitmap too big");
+  for(i = 0; i < bsum.n; i++){
+    bp = bread(dev, BBLOCK(i*BPB, sb));
+    end = min(BPB, sb.size - i*BPB);
+    bsum.sum[i].nfree = 0;
+    for(bi = 0; bi < end; bi++)
+      if(BFREE((uint*)bp->data, bi))
+        bsum.sum[i].nfree++;
+    bscan((uint*)bp->data, 0, end, end+1, &longest);
+    bsum.sum[i].maxrun = longest;
+    brelse(bp);
+  }
+}
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
+// Allocate a run of up to n disk blocks, near goal, and zero
+// them unless the caller is going to overwrite them. Returns
+// the first block, and the number allocated in *got.
+static uint
+ballocn(uint dev, uint goal, uint n, uint *got, int zero)
+{
+  int pass, k, i, from, end, bi, longest;
+  struct buf *bp;
+  uint *map, b, len;
+
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.rotor;
+  if(goal >= sb.size)
+    goal = 0;
+
+  // pass 0: at goal itself. pass 1: the first run of n
+  // blocks after goal. pass 2: any free block.
+  for(pass = 0; pass < 3; pass++){
+    for(k = 0; k <= bsum.n && (pass > 0 || k == 0); k++){
+      i = (goal/BPB + k) % bsum.n;
+      if(bsum.sum[i].nfree == 0 || (pass == 1 && bsum.sum[i].maxrun < n))
+        continue;
+      b = i * BPB;
+      from = k == 0 ? goal % BPB : 0;
+      end = min(BPB, sb.size - b);
+      bp = bread(dev, BBLOCK(b, sb));
+      map = (uint*)bp->data;
+      if(pass == 0)
+        bi = from < end && BFREE(map, from) ? from : -1;
+      else
+        bi = bscan(map, from, end, pass == 1 ? n : 1, &longest);
+      if(bi < 0){
+        if(pass == 1 && from == 0)
+          bsum.sum[i].maxrun = longest;
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        continue;
       }
+      for(len = 0; len < n && bi + len < end && BFREE(map, bi + len); len++)
+        map[(bi+len)/32] |= 1U << ((bi+len)%32);  // Mark block in use.
+      bsum.sum[i].nfree -= len;
+      log_write(bp);
+      brelse(bp);
+      bsum.rotor = b + bi + len;
+      for(k = 0; zero && k < len; k++)
+        bzero(dev, b + bi + k);
+      *got = len;
+      return b + bi;
     }
-    brelse(bp);
   }
   panic("balloc: out of blocks");
 }
 
+// Allocate a zeroed disk block, near goal.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint got;
+
+  return ballocn(dev, goal, 1, &got, 1);
+}
+
+// Free n disk blocks starting at b.
+static void
+bfreen(int dev, uint b, uint n)
+{
+  struct buf *bp;
+  int i, bi;
+
+  log_free(b, n);
+  while(n > 0){
+    i = b / BPB;
+    bp = bread(dev, BBLOCK(b, sb));
+    for(; n > 0 && b / BPB == i; b++, n--){
+      bi = b % BPB;
+      if(BFREE((uint*)bp->data, bi))
+        panic("freeing free block");
+      ((uint*)bp->data)[bi/32] &= ~(1U << (bi%32));
+      bsum.sum[i].nfree++;
+    }
+    // the run may have joined others; the next failed
+    // search of this bitmap block measures it again.
+    bsum.sum[i].maxrun = BPB;
+    log_write(bp);
+    brelse(bp);
+  }
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
 {
-  struct buf *bp;
-  int bi, m;
-
-  bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
-  m = 1 << (bi % 8);
-  if((bp->data[bi/8] & m) == 0)
-    panic("freeing free block");
-  bp->data[bi/8] &= ~m;
-  log_write(bp);
-  brelse(bp);
+  bfreen(dev, b, 1);
 }
 
 // Inodes.
@@ -128,17 +270,17 @@ bfree(int dev, uint b)
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
+//   may be recycled if ip->ref is zero. Otherwise ip->ref
+//   tracks the number of in-memory pointers to the entry
+//   (open files and current directories). iget() finds or
 //   creates a cache entry and increments its ref; iput()
 //   decrements ref.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid, which stays set while the entry is cached,
+//   unless iput() frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -162,44 +304,290 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The inode cache is a hash table keyed on (dev, inum), with
+// a spin-lock per bucket. A bucket's lock protects its chain,
+// and the ref of every inode on it; since ip->ref indicates
+// whether an entry is in use, and ip->dev and ip->inum which
+// bucket it is on, one must hold the bucket lock while using
+// any of those fields.
+//
+// An inode whose ref falls to zero stays on its chain, with
+// its contents still valid, and goes on an LRU list, so that
+// iget() can find it again without reading the disk. A miss
+// takes a new inode from a slab cache while there are fewer
+// than NINODE, or fewer than NINODEMAX and plenty of free
+// memory; otherwise it recycles the least recently used
+// unreferenced inode. When kalloc() runs out of memory, it
+// calls ireclaim() to free all the unreferenced inodes.
+//
+// Lock order: bucket lock, then icache.lrulock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
-struct {
+#define NIBUCKETSHIFT 6
+#define NIBUCKET (1 << NIBUCKETSHIFT)
+#define IHASH(dev, inum) \
+  (((((uint64)(dev) << 32) | (inum)) * 0x9E3779B97F4A7C15ULL) >> (64 - NIBUCKETSHIFT))
+
+// grow the cache past NINODE only while this many pages are free.
+#define IHEADROOM 1024
+
+struct ibucket {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *head;    // hash chain, through next
+};
+
+struct {
+  struct ibucket bucket[NIBUCKET];
+  struct spinlock lrulock;   // protects lru, the lprev/lnext links, and n
+  struct inode lru;          // unreferenced inodes; lru.lnext is most recent
+  int n;                     // inodes in the cache
 } icache;
 
+static struct kmem_cache inodecache;
+
 void
 iinit()
 {
-  int i = 0;
-  
-  initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
+  int i;
+
+  for(i = 0; i < NIBUCKET; i++)
+    initlock(&icache.bucket[i].lock, "icache");
+  initlock(&icache.lrulock, "icache.lru");
+  icache.lru.lprev = icache.lru.lnext = &icache.lru;
+  kmem_cache_init(&inodecache, "inodecache", sizeof(struct inode));
+}
+
+static struct ibucket*
+ibucket(uint dev, uint inum)
+{
+  return &icache.bucket[IHASH(dev, inum)];
+}
+
+// Put ip on the LRU list, at the most recently used end
+// if mru is set, else at the end that isteal() takes from.
+// Caller holds ip's bucket lock and icache.lrulock.
+static void
+lru_insert(struct inode *ip, int mru)
+{
+  struct inode *prev;
+
+  prev = mru ? &icache.lru : icache.lru.lprev;
+  ip->lnext = prev->lnext;
+  ip->lprev = prev;
+  prev->lnext->lprev = ip;
+  prev->lnext = ip;
+}
+
+static void
+lru_remove(struct inode *ip)
+{
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext->lprev = ip->lprev;
+  ip->lnext = ip->lprev = 0;
+}
+
+// Take the least recently used unreferenced inode out of the
+// cache. Returns it, private to the caller, or 0 if there
+// is none.
+static struct inode*
+isteal(void)
+{
+  struct inode *ip, **pp;
+  struct ibucket *bk;
+
+  for(;;){
+    acquire(&icache.lrulock);
+    ip = icache.lru.lprev;
+    if(ip == &icache.lru){
+      release(&icache.lrulock);
+      return 0;
+    }
+    bk = ibucket(ip->dev, ip->inum);
+    release(&icache.lrulock);
+
+    // take the locks in order, and check that ip is still
+    // unreferenced in the meantime.
+    acquire(&bk->lock);
+    acquire(&icache.lrulock);
+    if(ip->lnext == 0 || ip->ref != 0 || ibucket(ip->dev, ip->inum) != bk){
+      release(&icache.lrulock);
+      release(&bk->lock);
+      continue;
+    }
+    lru_remove(ip);
+    release(&icache.lrulock);
+    for(pp = &bk->head; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    release(&bk->lock);
+    return ip;
+  }
+}
+
+// Give an inode taken out of the cache back to the slab cache.
+static void
+ifree(struct inode *ip)
+{
+#ifdef LAB_LOCK
+  freelock(&ip->lock.lk);
+#endif
+  kmem_cache_free(&inodecache, ip);
+  acquire(&icache.lrulock);
+  icache.n--;
+  release(&icache.lrulock);
+}
+
+// Return a new or recycled inode, not yet in the cache.
+static struct inode*
+inew(void)
+{
+  struct inode *ip;
+
+  if(icache.n >= NINODE && (icache.n >= NINODEMAX || kfreemem() <= IHEADROOM) &&
+     (ip = isteal()) != 0)
+    return ip;
+  if((ip = kmem_cache_alloc(&inodecache)) == 0){
+    if((ip = isteal()) == 0)
+      panic("iget: no inodes");
+    return ip;
   }
+  memset(ip, 0, sizeof(*ip));
+  initsleeplock(&ip->lock, "inode");
+  acquire(&icache.lrulock);
+  icache.n++;
+  release(&icache.lrulock);
+  return ip;
+}
+
+// Free all the unreferenced inodes. Called by kalloc() when
+// it runs out of memory, before kmem_cache_reap(), which
+// gives their pages back. Returns the number freed.
+int
+ireclaim(void)
+{
+  struct inode *ip;
+  int n;
+
+  for(n = 0; (ip = isteal()) != 0; n++)
+    ifree(ip);
+  return n;
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// Free-inode summary.
+//
+// So that ialloc() needn't read the inode blocks to find a
+// free dinode, fsinit() records which are free in a bitmap,
+// which ialloc() and iput() keep up to date. Each CPU has its
+// own cursor into the bitmap, starting in its own part of it,
+// so concurrent creates don't all contend for the same inodes
+// and inode blocks.
+
+#define NIMAP 4096  // most inodes the summary can describe
+
+static struct {
+  struct spinlock lock;
+  uint nfree;
+  uint map[NIMAP/32];     // bit set if the inode is free
+  uint cursor[NCPU];      // where each CPU's next search starts
+} isum;
+
+// Read the inode blocks and build the summary.
+static void
+isuminit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  int inum, i;
+
+  initlock(&isum.lock, "isum");
+  if(sb.ninodes > NIMAP)
+    panic("isuminit: too many inodes");
+  bp = 0;
+  for(inum = 1; inum < sb.ninodes; inum++){
+    if(bp == 0 || inum%IPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
+    }
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type == 0){
+      isum.map[inum/32] |= 1U << (inum%32);
+      isum.nfree++;
+    }
+  }
+  if(bp)
+    brelse(bp);
+  for(i = 0; i < NCPU; i++)
+    isum.cursor[i] = 1 + i*(sb.ninodes/NCPU);
+}
+
+// Take an inode that the summary says is free, or return 0.
+static uint
+isumtake(void)
+{
+  uint inum, w, k;
+  int i;
+
+  acquire(&isum.lock);
+  if(isum.nfree == 0){
+    release(&isum.lock);
+    return 0;
+  }
+  i = cpuid();
+  inum = isum.cursor[i];
+  if(inum >= sb.ninodes)
+    inum = 1;
+  // search a word at a time from the cursor, wrapping once.
+  for(k = 0; ; k++){
+    w = isum.map[inum/32] & (~0U << (inum%32));
+    if(w != 0){
+      inum = inum/32*32;
+      while((w & 1) == 0){
+        w >>= 1;
+        inum++;
+      }
+      if(inum < sb.ninodes)
+        break;
+    }
+    inum = (inum/32 + 1) * 32;
+    if(inum >= sb.ninodes)
+      inum = 0;
+    if(k > NIMAP/32)
+      panic("isumtake");
+  }
+  isum.map[inum/32] &= ~(1U << (inum%32));
+  isum.nfree--;
+  isum.cursor[i] = inum + 1;
+  release(&isum.lock);
+  return inum;
+}
+
+// Record that inode inum is free.
+static void
+isumfree(uint inum)
+{
+  acquire(&isum.lock);
+  isum.map[inum/32] |= 1U << (inum%32);
+  isum.nfree++;
+  release(&isum.lock);
+}
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode.
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
+  while((inum = isumtake()) != 0){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
@@ -209,6 +597,7 @@ ialloc(uint dev, short type)
       brelse(bp);
       return iget(dev, inum);
     }
+    // the summary was wrong; the inode stays marked in use.
     brelse(bp);
   }
   panic("ialloc: no inodes");
@@ -231,7 +620,12 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  if(ip->ndelay > 0 && ip->size > ip->xblocks*BSIZE)
+    dip->size = ip->xblocks*BSIZE;  // the rest has no disk blocks yet
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->xaddr = ip->xaddr;
+  dip->daddr = ip->daddr;
+  dip->xblocks = ip->xblocks;
   log_write(bp);
   brelse(bp);
 }
@@ -242,32 +636,48 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&icache.lock);
-
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache.lock);
-      return ip;
+  struct ibucket *bk;
+  struct inode *ip, *new;
+
+  bk = ibucket(dev, inum);
+  new = 0;
+  for(;;){
+    acquire(&bk->lock);
+
+    // Is the inode already cached?
+    for(ip = bk->head; ip; ip = ip->next){
+      if(ip->dev == dev && ip->inum == inum){
+        if(ip->ref++ == 0){
+          acquire(&icache.lrulock);
+          lru_remove(ip);
+          release(&icache.lrulock);
+        }
+        release(&bk->lock);
+        if(new)
+          ifree(new);  // someone else cached it meanwhile
+        return ip;
+      }
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
+    if(new)
+      break;
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+    // get an inode without holding the bucket lock,
+    // since kalloc() may call ireclaim().
+    release(&bk->lock);
+    new = inew();
+  }
 
-  ip = empty;
+  ip = new;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&icache.lock);
+  ip->raoff = 0;
+  ip->rawin = 0;
+  ip->ranext = 0;
+  ip->next = bk->head;
+  bk->head = ip;
+  release(&bk->lock);
 
   return ip;
 }
@@ -277,9 +687,12 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk;
+
+  bk = ibucket(ip->dev, ip->inum);
+  acquire(&bk->lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -290,6 +703,7 @@ ilock(struct inode *ip)
 {
   struct buf *bp;
   struct dinode *dip;
+  int i;
 
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
@@ -304,7 +718,16 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->xaddr = dip->xaddr;
+    ip->daddr = dip->daddr;
+    ip->xblocks = dip->xblocks;
+    ip->xhint.len = 0;
+    ip->nextblk = 0;
+    if(ip->xaddr == 0 && ip->daddr == 0)
+      for(i = 0; i < NEXTENT; i++)
+        if(ip->ext[i].len > 0)
+          ip->nextblk = ip->ext[i].start + ip->ext[i].len;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -332,7 +755,10 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk;
+
+  bk = ibucket(ip->dev, ip->inum);
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,20 +767,38 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&icache.lock);
+    release(&bk->lock);
 
+    if(ip->type == T_DIR)
+      dcache_purge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    isumfree(ip->inum);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
+    acquire(&bk->lock);
+  } else if(ip->ref == 1 && ip->delay != 0){
+    // last reference: give the delayed blocks disk blocks,
+    // which fileclose() normally has done already.
+    acquiresleep(&ip->lock);
+    release(&bk->lock);
+    iflush(ip);
+    idiscard(ip);
+    releasesleep(&ip->lock);
+    acquire(&bk->lock);
   }
 
   ip->ref--;
-  release(&icache.lock);
+  if(ip->ref == 0){
+    // keep it cached; a freed inode is the first to recycle.
+    acquire(&icache.lrulock);
+    lru_insert(ip, ip->valid);
+    release(&icache.lrulock);
+  }
+  release(&bk->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -368,40 +812,277 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk. The first ip->xblocks blocks are
+// described by extents, runs of consecutive disk blocks: up
+// to NEXTENT in ip->ext[], then up to NXINDIRECT more in block
+// ip->xaddr. Once all the extents are used, the next blocks
+// are listed in the NINDIRECT blocks that doubly-indirect
+// block ip->daddr lists.
+
+// Return the disk block address of file block bn, which the
+// extents describe.
+static uint
+xmap(struct inode *ip, uint bn)
+{
+  struct extent *e;
+  struct buf *bp;
+  uint addr;
+  int i;
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+  for(i = 0; i < NEXTENT; i++){
+    if(bn < ip->ext[i].len)
+      return ip->ext[i].start + bn;
+    bn -= ip->ext[i].len;
+  }
+
+  // try the extent found last time before reading block xaddr.
+  if(bn >= ip->xhbn && bn - ip->xhbn < ip->xhint.len)
+    return ip->xhint.start + bn - ip->xhbn;
+  bp = bread(ip->dev, ip->xaddr);
+  e = (struct extent*)bp->data;
+  ip->xhbn = 0;
+  for(i = 0; i < NXINDIRECT; i++){
+    if(bn - ip->xhbn < e[i].len)
+      break;
+    ip->xhbn += e[i].len;
+  }
+  if(i == NXINDIRECT)
+    panic("xmap");
+  ip->xhint = e[i];
+  addr = e[i].start + bn - ip->xhbn;
+  brelse(bp);
+  return addr;
+}
+
+// Add the n disk blocks starting at addr to the end of the
+// extents, by growing the last extent if they follow it, or
+// else starting a new one. Returns 0 if all the extents are
+// used.
+static int
+xappend(struct inode *ip, uint addr, uint n)
+{
+  struct extent *e;
+  struct buf *bp;
+  int i;
+
+  for(i = 0; i < NEXTENT && ip->ext[i].len > 0; i++)
+    ;
+  if(i > 0 && ip->ext[i-1].start + ip->ext[i-1].len == addr && ip->xaddr == 0){
+    ip->ext[i-1].len += n;
+    ip->xblocks += n;
+    return 1;
+  }
+  if(i < NEXTENT){
+    ip->ext[i].start = addr;
+    ip->ext[i].len = n;
+    ip->xblocks += n;
+    return 1;
+  }
+
+  if(ip->xaddr == 0){
+    // not at addr+n, where the file's next run will want to
+    // go, but as near the start of the data blocks as there
+    // is room.
+    ip->xaddr = balloc(ip->dev, sb.bmapstart + bsum.n);
+  }
+  bp = bread(ip->dev, ip->xaddr);
+  e = (struct extent*)bp->data;
+  for(i = 0; i < NXINDIRECT && e[i].len > 0; i++)
+    ;
+  if(i > 0 && e[i-1].start + e[i-1].len == addr){
+    e[i-1].len += n;
+  } else if(i < NXINDIRECT){
+    e[i].start = addr;
+    e[i].len = n;
+  } else {
+    brelse(bp);
+    return 0;
+  }
+  log_write(bp);
+  brelse(bp);
+  ip->xblocks += n;
+  return 1;
+}
+
+// Return the disk block address of block bn in the blocks
+// that block ip->daddr lists, allocating the (doubly-)indirect
+// blocks if necessary. If there is no such block, use addr,
+// or allocate one if addr is 0: see bmap() for fresh.
 static uint
-bmap(struct inode *ip, uint bn)
+dmap(struct inode *ip, uint bn, uint addr, uint *fresh)
 {
-  uint addr, *a;
+  uint got;
+  uint ind, *a;
   struct buf *bp;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
+  if(ip->daddr == 0)
+    ip->daddr = balloc(ip->dev, ip->nextblk);
+  bp = bread(ip->dev, ip->daddr);
+  a = (uint*)bp->data;
+  if((ind = a[bn / NINDIRECT]) == 0){
+    a[bn / NINDIRECT] = ind = balloc(ip->dev, ip->nextblk);
+    log_write(bp);
   }
-  bn -= NDIRECT;
+  brelse(bp);
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+  bp = bread(ip->dev, ind);
+  a = (uint*)bp->data;
+  if(a[bn % NINDIRECT] == 0){
+    if(addr == 0)
+      addr = ballocn(ip->dev, ip->nextblk, 1, &got, fresh == 0);
+    if(fresh)
+      *fresh = 1;
+    a[bn % NINDIRECT] = addr;
+    ip->nextblk = addr + 1;
+    log_write(bp);
+  }
+  addr = a[bn % NINDIRECT];
+  brelse(bp);
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one, and if the
+// caller is going to need the n-1 blocks after it as well,
+// tries to allocate them in the same run.
+// If fresh is not 0, the caller is going to overwrite all n
+// blocks entirely, so new blocks aren't zeroed; *fresh is set
+// to the number of blocks from bn on that were just allocated.
+static uint
+bmap(struct inode *ip, uint bn, uint n, uint *fresh)
+{
+  uint addr, got;
+
+  if(fresh)
+    *fresh = 0;
+  if(bn < ip->xblocks)
+    return xmap(ip, bn);
+  if(bn >= MAXFILE)
+    panic("bmap: out of range");
+
+  addr = 0;
+  if(ip->daddr == 0){
+    if(bn != ip->xblocks)
+      panic("bmap: hole");
+    addr = ballocn(ip->dev, ip->nextblk, n, &got, fresh == 0);
+    ip->nextblk = addr + got;
+    if(xappend(ip, addr, got)){
+      if(fresh)
+        *fresh = got;
+      return addr;
+    }
+    // the extents are full: only addr is needed.
+    if(got > 1)
+      bfreen(ip->dev, addr + 1, got - 1);
+  }
+  return dmap(ip, bn - ip->xblocks, addr, fresh);
+}
+
+// Delayed allocation.
+//
+// Blocks that writei() appends to a regular file don't get
+// disk blocks right away. Up to NDELAY of them, the file blocks
+// just past ip->xblocks, are kept in memory, in page ip->delay,
+// until the window fills or a file open for writing it is
+// closed. iflush() then allocates them all as one run, and
+// writes them without zeroing them first. A file that is
+// truncated or deleted before then never uses disk blocks for
+// them at all. The size in the on-disk inode covers only blocks
+// that have disk blocks. The page is kept for the next delayed
+// blocks until the last reference to the inode goes away.
+
+// Return the memory holding file block bn, if its allocation
+// is delayed, or 0.
+static char*
+idelayed(struct inode *ip, uint bn)
+{
+  if(bn >= ip->xblocks && bn - ip->xblocks < ip->ndelay)
+    return ip->delay + (bn - ip->xblocks)*BSIZE;
+  return 0;
+}
+
+// Give ip's delayed blocks disk blocks, and write them.
+// Caller must hold ip->lock, in a transaction that has room
+// for IFLUSHBLOCKS blocks.
+void
+iflush(struct inode *ip)
+{
+  struct buf *bp;
+  uint base, addr, got, i, k;
+
+  if(ip->ndelay == 0)
+    return;
+  base = ip->xblocks;
+  for(i = 0; i < ip->ndelay; i += got){
+    if(ip->daddr == 0){
+      addr = ballocn(ip->dev, ip->nextblk, ip->ndelay - i, &got, 0);
+      ip->nextblk = addr + got;
+      if(!xappend(ip, addr, got)){
+        // the extents are full: only addr is needed.
+        if(got > 1)
+          bfreen(ip->dev, addr + 1, got - 1);
+        addr = dmap(ip, base + i - ip->xblocks, addr, &got);
+        got = 1;
+      }
+    } else {
+      // once there is a doubly-indirect block the extents
+      // mustn't grow, or the blocks it lists would shift.
+      addr = dmap(ip, base + i - ip->xblocks, 0, &got);
+      got = 1;
+    }
+    for(k = 0; k < got; k++){
+      bp = bnew(ip->dev, addr + k);
+      memmove(bp->data, ip->delay + (i+k)*BSIZE, BSIZE);
+      log_write_data(bp);
+      brelse(bp);
     }
-    brelse(bp);
-    return addr;
   }
+  ip->ndelay = 0;  // keep ip->delay for the next ones
+  iupdate(ip);
+}
 
-  panic("bmap: out of range");
+// Drop ip's delayed blocks, and free their page.
+static void
+idiscard(struct inode *ip)
+{
+  if(ip->delay)
+    kfree(ip->delay);
+  ip->delay = 0;
+  ip->ndelay = 0;
+}
+
+// Return the memory for file block bn, if writei() should
+// delay its allocation, starting a new delayed block if bn
+// is the next one. Returns 0 if bn has or gets a disk block.
+// Caller must hold ip->lock, in a transaction.
+static char*
+idelay(struct inode *ip, uint bn)
+{
+  char *p;
+
+  if(ip->type != T_FILE || ip->daddr != 0 || bn < ip->xblocks)
+    return 0;
+  if((p = idelayed(ip, bn)) != 0)
+    return p;
+  if(ip->ndelay == NDELAY){
+    iflush(ip);
+    if(ip->daddr != 0)
+      return 0;
+  }
+  if(ip->delay == 0 && (ip->delay = kalloc()) == 0)
+    return 0;
+  p = ip->delay + ip->ndelay*BSIZE;
+  memset(p, 0, BSIZE);
+  ip->ndelay++;
+  return p;
+}
+
+// Free the blocks of extent e.
+static void
+xfree(uint dev, struct extent *e)
+{
+  if(e->len > 0)
+    bfreen(dev, e->start, e->len);
 }
 
 // Truncate inode (discard contents).
@@ -410,26 +1091,46 @@ void
 itrunc(struct inode *ip)
 {
   int i, j;
-  struct buf *bp;
-  uint *a;
+  struct buf *bp, *ibp;
+  uint *a, *b;
+
+  idiscard(ip);
+  for(i = 0; i < NEXTENT; i++){
+    xfree(ip->dev, &ip->ext[i]);
+    ip->ext[i].start = 0;
+    ip->ext[i].len = 0;
+  }
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  if(ip->xaddr){
+    bp = bread(ip->dev, ip->xaddr);
+    for(i = 0; i < NXINDIRECT; i++)
+      xfree(ip->dev, (struct extent*)bp->data + i);
+    brelse(bp);
+    bfree(ip->dev, ip->xaddr);
+    ip->xaddr = 0;
   }
+  ip->xblocks = 0;
+  ip->xhint.len = 0;
+  ip->nextblk = 0;
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+  if(ip->daddr){
+    bp = bread(ip->dev, ip->daddr);
     a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+    for(i = 0; i < NINDIRECT; i++){
+      if(a[i] == 0)
+        continue;
+      ibp = bread(ip->dev, a[i]);
+      b = (uint*)ibp->data;
+      for(j = 0; j < NINDIRECT; j++){
+        if(b[j])
+          bfree(ip->dev, b[j]);
+      }
+      brelse(ibp);
+      bfree(ip->dev, a[i]);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    bfree(ip->dev, ip->daddr);
+    ip->daddr = 0;
   }
 
   ip->size = 0;
@@ -448,6 +1149,46 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Sequential read-ahead. A readi() that starts where the
+// previous one ended doubles the inode's window, up to
+// NREADAHEAD blocks; any other read closes the window.
+// Blocks in the window past the end of the read are handed
+// to breadahead(), each once, as one batch, and without
+// waiting for them.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, nblocks, k;
+  uint blocknos[NREADAHEAD];
+
+  if(off == ip->raoff && n > 0){
+    ip->rawin = ip->rawin ? 2*ip->rawin : 1;
+    if(ip->rawin > NREADAHEAD)
+      ip->rawin = NREADAHEAD;
+  } else {
+    ip->rawin = 0;
+    ip->ranext = 0;
+  }
+  ip->raoff = off + n;
+  if(ip->rawin == 0)
+    return;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  if(ip->ndelay > 0)
+    nblocks = ip->xblocks;  // the rest is in memory
+  bn = (off + n + BSIZE - 1) / BSIZE;
+  end = min(bn + ip->rawin, nblocks);
+  if(bn < ip->ranext)
+    bn = ip->ranext;
+  for(k = 0; bn + k < end; k++)
+    blocknos[k] = bmap(ip, bn + k, 1, 0);
+  // if the disk queue is full, the rest wait for next time.
+  bn += breadahead(ip->dev, blocknos, k);
+  if(bn > ip->ranext)
+    ip->ranext = bn;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -457,6 +1198,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  char *p;
 
   if(off > ip->size || off + n < off)
     return 0;
@@ -464,8 +1206,15 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    if((p = idelayed(ip, off/BSIZE)) != 0){
+      if(either_copyout(user_dst, dst, p + (off % BSIZE), m) == -1){
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    bp = bread(ip->dev, bmap(ip, off/BSIZE, 1, 0));
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -473,6 +1222,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     }
     brelse(bp);
   }
+  if(tot == n)
+    readahead(ip, off - n, n);
   return tot;
 }
 
@@ -483,23 +1234,55 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr, nfresh;
   struct buf *bp;
+  char *p;
+  int fresh;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  nfresh = 0;
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    if((p = idelay(ip, off/BSIZE)) != 0){
+      if(either_copyin(p + (off % BSIZE), user_src, src, m) == -1){
+        n = -1;
+        break;
+      }
+      continue;
+    }
+    // blocks that the rest of the write fills entirely needn't
+    // be zeroed when they are allocated, or read.
+    if(m == BSIZE && nfresh == 0)
+      addr = bmap(ip, off/BSIZE, (n - tot)/BSIZE, &nfresh);
+    else
+      addr = bmap(ip, off/BSIZE, 1, 0);
+    fresh = nfresh > 0;
+    if(fresh){
+      nfresh--;
+      bp = bnew(ip->dev, addr);
+    } else {
+      bp = bread(ip->dev, addr);
+    }
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+      if(fresh){
+        // zero the new blocks after all.
+        memset(bp->data, 0, BSIZE);
+        log_write(bp);
+        while(nfresh > 0)
+          bzero(ip->dev, addr + nfresh--);
+      }
       brelse(bp);
       n = -1;
       break;
     }
-    log_write(bp);
+    if(ip->type == T_FILE)
+      log_write_data(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -508,7 +1291,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       ip->size = off;
     // write the i-node back to disk even if the size didn't change
     // because the loop above might have called bmap() and added a new
-    // block to ip->addrs[].
+    // block to the extents.
     iupdate(ip);
   }
 
@@ -523,6 +1306,185 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Hash a directory entry name.
+static uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261U;  // FNV-1a
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Return a locked buf with block bn of directory dp.
+static struct buf*
+dirblock(struct inode *dp, uint bn)
+{
+  return bread(dp->dev, bmap(dp, bn, 1, 0));
+}
+
+// Add a zeroed block to the end of directory dp, and return
+// it locked, with its block number in *bn.
+static struct buf*
+dirgrow(struct inode *dp, uint *bn)
+{
+  struct buf *bp;
+
+  *bn = dp->size / BSIZE;
+  bp = dirblock(dp, *bn);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return bp;
+}
+
+// Look for name in hashed directory dp. If found, set *poff
+// to the byte offset of its entry and return its inum;
+// otherwise return 0.
+static uint
+hlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint h, lb, inum;
+  int i;
+
+  h = dirhash(name);
+  bp = dirblock(dp, 0);
+  lb = DINDEX(bp->data, h & ((1 << DDEPTH(bp->data)) - 1));
+  brelse(bp);
+  while(lb){
+    bp = dirblock(dp, lb);
+    de = (struct dirent*)bp->data;
+    for(i = 1; i < DPB; i++){
+      if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+        *poff = lb*BSIZE + i*sizeof(*de);
+        inum = de[i].inum;
+        brelse(bp);
+        return inum;
+      }
+    }
+    lb = DNEXT(bp->data);
+    brelse(bp);
+  }
+  return 0;
+}
+
+// Add an entry (name, inum) to hashed directory dp, which
+// doesn't have name. Returns the byte offset of the entry.
+static uint
+hinsert(struct inode *dp, char *name, uint inum)
+{
+  struct buf *ib, *lp, *np;
+  struct dirent *de, *nde;
+  uint h, gd, depth, lb, nb, i, j;
+
+  h = dirhash(name);
+  for(;;){
+    ib = dirblock(dp, 0);
+    gd = DDEPTH(ib->data);
+    lb = DINDEX(ib->data, h & ((1 << gd) - 1));
+    lp = dirblock(dp, lb);
+    for(;;){
+      de = (struct dirent*)lp->data;
+      for(i = 1; i < DPB && de[i].inum != 0; i++)
+        ;
+      if(i < DPB){
+        strncpy(de[i].name, name, DIRSIZ);
+        de[i].inum = inum;
+        log_write(lp);
+        brelse(lp);
+        brelse(ib);
+        return lb*BSIZE + i*sizeof(*de);
+      }
+      if(DNEXT(lp->data) == 0)
+        break;
+      lb = DNEXT(lp->data);
+      brelse(lp);
+      lp = dirblock(dp, lb);
+    }
+
+    // the leaf is full.
+    depth = DDEPTH(lp->data);
+    if(depth == DIRMAXDEPTH){
+      np = dirgrow(dp, &nb);
+      DDEPTH(np->data) = depth;
+      DNEXT(lp->data) = nb;
+      log_write(np);
+      log_write(lp);
+      brelse(np);
+      brelse(lp);
+      brelse(ib);
+      continue;
+    }
+    if(depth == gd){
+      for(i = 1 << gd; i < 2 << gd; i++)
+        DINDEX(ib->data, i) = DINDEX(ib->data, i - (1 << gd));
+      DDEPTH(ib->data) = ++gd;
+    }
+
+    // split the leaf: names with bit depth of their hash
+    // set move to a new leaf.
+    np = dirgrow(dp, &nb);
+    DDEPTH(lp->data) = DDEPTH(np->data) = depth + 1;
+    de = (struct dirent*)lp->data;
+    nde = (struct dirent*)np->data;
+    for(i = j = 1; i < DPB; i++){
+      if(de[i].inum != 0 && (dirhash(de[i].name) >> depth) & 1){
+        nde[j++] = de[i];
+        memset(&de[i], 0, sizeof(de[i]));
+      }
+    }
+    for(i = 0; i < 1 << gd; i++)
+      if(DINDEX(ib->data, i) == lb && (i >> depth) & 1)
+        DINDEX(ib->data, i) = nb;
+    log_write(np);
+    log_write(lp);
+    log_write(ib);
+    brelse(np);
+    brelse(lp);
+    brelse(ib);
+    // the moved names' offsets changed.
+    dcache_purge(dp->dev, dp->inum);
+  }
+}
+
+// Turn linear directory dp, whose first block is full, into a
+// hashed one. Returns 0 if there was no memory to do it.
+static int
+dirconvert(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirent *de;
+  char *old;
+  uint lb;
+  int i;
+
+  if((old = kalloc()) == 0)
+    return 0;
+  bp = dirblock(dp, 0);
+  memmove(old, bp->data, BSIZE);
+  memset(bp->data, 0, BSIZE);
+  DDEPTH(bp->data) = 0;
+  DINDEX(bp->data, 0) = 1;
+  log_write(bp);
+  brelse(bp);
+  bp = dirgrow(dp, &lb);  // leaf 1, depth 0
+  brelse(bp);
+  dp->dirfmt = DIRHASHED;
+  iupdate(dp);
+
+  de = (struct dirent*)old;
+  for(i = 0; i < DPB; i++)
+    if(de[i].inum != 0)
+      hinsert(dp, de[i].name, de[i].inum);
+  kfree(old);
+  dcache_purge(dp->dev, dp->inum);
+  return 1;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -534,6 +1496,24 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcache_lookup(dp->dev, dp->inum, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if(dp->dirfmt == DIRHASHED){
+    inum = hlookup(dp, name, &off);
+    dcache_enter(dp->dev, dp->inum, name, inum, inum ? off : 0);
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -544,10 +1524,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcache_enter(dp->dev, dp->inum, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcache_enter(dp->dev, dp->inum, name, 0, 0);
   return 0;
 }
 
@@ -565,6 +1547,12 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(dp->dirfmt == DIRHASHED){
+    off = hinsert(dp, name, inum);
+    dcache_enter(dp->dev, dp->inum, name, inum, off);
+    return 0;
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -573,10 +1561,18 @@ dirlink(struct inode *dp, char *name, uint inum)
       break;
   }
 
+  // A full one-block directory becomes hashed.
+  if(off == BSIZE && dp->size == BSIZE && dirconvert(dp)){
+    off = hinsert(dp, name, inum);
+    dcache_enter(dp->dev, dp->inum, name, inum, off);
+    return 0;
+  }
+
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcache_enter(dp->dev, dp->inum, name, inum, off);
 
   return 0;
 }
@@ -620,6 +1616,35 @@ skipelem(char *path, char *name)
   return path;
 }
 
+// Look up name in directory dp using only the directory name
+// cache, without locking dp; a name is cached only while its
+// directory exists, so a hit also means dp is a directory.
+// Returns 1 and sets *next, to 0 if there is no such name, if
+// the cache has the answer; returns 0 if dp must be read.
+static int
+dircached(struct inode *dp, char *name, struct inode **next)
+{
+  struct inode *ip;
+  uint inum, inum1, off;
+
+  if(!dcache_lookup(dp->dev, dp->inum, name, &inum, &off))
+    return 0;
+  if(inum == 0){
+    *next = 0;
+    return 1;
+  }
+  // the name may have been unlinked, and the inode freed,
+  // before iget(); now that ip holds a reference, check that
+  // the name still refers to it.
+  ip = iget(dp->dev, inum);
+  if(!dcache_lookup(dp->dev, dp->inum, name, &inum1, &off) || inum1 != inum){
+    iput(ip);
+    return 0;
+  }
+  *next = ip;
+  return 1;
+}
+
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
@@ -635,6 +1660,15 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // most components are in the name cache, and needn't
+    // lock ip; the final parent is returned checked, so lock it.
+    if(!(nameiparent && *path == '\0') && dircached(ip, name, &next)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -24,20 +24,38 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// A run of len data blocks starting at disk block start.
+struct extent {
+  uint start;
+  uint len;
+};
+
+#define NEXTENT 5
+#define NXINDIRECT (BSIZE / sizeof(struct extent))
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NEXTENT + NXINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
   short type;           // File type
-  short major;          // Major device number (T_DEVICE only)
+  union {
+    short major;        // Major device number (T_DEVICE only)
+    short dirfmt;       // Directory format (T_DIR only), below
+  };
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT];  // The first runs of data blocks
+  uint xaddr;           // Block of NXINDIRECT more extents
+  uint daddr;           // Doubly-indirect block, once the extents are full
+  uint xblocks;         // Number of blocks in the extents
 };
 
+// Directory formats, in a T_DIR inode's dirfmt.
+#define DIRLINEAR 0  // an array of dirents
+#define DIRHASHED 1  // hashed into leaf blocks; see below
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -50,6 +68,9 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
+// Most bitmap blocks a file system has.
+#define NBMAP (FSSIZE/BPB + 1)
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
@@ -58,3 +79,40 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+#define DPB (BSIZE / sizeof(struct dirent))  // dirents per block
+
+// A directory that outgrows its first block is hashed, which
+// its inode's dirfmt, DIRHASHED, records. Block 0 is an
+// index of 1<<depth pointers to leaf blocks, selected by the
+// low bits of a name's hash. A leaf holds the names whose
+// hashes agree in its own depth low bits; a full leaf splits
+// in two, doubling the index if need be, and at DIRMAXDEPTH
+// gets an overflow leaf instead. The index and leaf headers
+// are in dirent slots with inum 0, so a directory still reads
+// as an array of dirents.
+#define DIRMAXDEPTH 8
+#define DDEPTH(data) ((data)[2])   // depth, in slot 0 of the index or a leaf
+#define DNEXT(data) (*(ushort*)((data) + 4))  // a leaf's overflow leaf
+#define DINDEX(data, i) (*(ushort*)((data) + 16*(1 + (i)/7) + 2 + 2*((i)%7)))
+
+// Most blocks that dirlink() may write to a hashed directory
+// beyond those of a linear one: the index, the old leaf, up to
+// DIRMAXDEPTH splits and an overflow leaf, each with a bitmap
+// block, and the extent and indirect blocks that map them.
+#define DIRLINKBLOCKS (1 + 1 + 2*(DIRMAXDEPTH+1) + 3)
+
+// Most blocks that iflush() may write: the delayed blocks, a
+// bitmap block for each run they're allocated in, the extent,
+// doubly-indirect and indirect blocks with their bitmap
+// blocks, and the inode.
+#define IFLUSHBLOCKS (2*NDELAY + 3 + 3 + 1)
+
+// Most blocks that itrunc() may write: every bitmap block,
+// since a fragmented file can have blocks anywhere, and the
+// inode.
+#define ITRUNCBLOCKS (NBMAP + 1)
+
+// Most blocks the last iput() of a file may write, by flushing
+// its delayed blocks or by freeing it.
+#define IPUTBLOCKS (IFLUSHBLOCKS > ITRUNCBLOCKS ? IFLUSHBLOCKS : ITRUNCBLOCKS)
+
@@ -1,6 +1,21 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// and physically contiguous runs of 2^order pages.
+//
+// All free memory belongs to a binary buddy allocator,
+// which splits and coalesces blocks of 2^order pages.
+//
+// Single pages are cached on per-CPU free lists, so kalloc()
+// and kfree() on different CPUs don't contend. A CPU whose list
+// is empty refills it with a batch of pages from the buddy
+// allocator, or steals a batch from another CPU's list; a CPU
+// whose list grows too long drains a batch back to the buddy
+// allocator so that the pages can coalesce.
+//
+// Each CPU also keeps a small pool of pages that were zeroed
+// while the CPU was idle, which kalloc_zeroed() hands out
+// without a memset on the allocation path.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +24,25 @@
 #include "riscv.h"
 #include "defs.h"
 
+// how many pages a CPU moves at a time between its own
+// list and another CPU's list or the buddy allocator.
+#define NSTEAL 64
+#define NBATCHORDER 5   // refill from buddy in blocks of 32 pages
+
+// how many pre-zeroed pages each CPU tries to keep.
+#define NZERO 64
+
+// largest buddy block is 2^MAXORDER pages.
+#define MAXORDER 10
+
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+
+// fill pages with junk on kfree() and kalloc() to catch
+// dangling references and uninitialized use. defaults to
+// the KJUNK build option; may be changed (e.g. from gdb)
+// before kinit() runs.
+int kjunk = KJUNK;
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,65 +52,503 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;           // number of pages on freelist
+  struct run *zerolist; // pages known to be all zeroes
+  int nzero;           // number of pages on zerolist
+  char lockname[8];
+};
+
+struct kmem kmems[NCPU];
+
+// a free buddy block; lives in the block's first page.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+struct {
+  struct spinlock lock;
+  char *base;                    // address of page 0
+  int npage;                     // pages managed
+  struct block free[MAXORDER+1]; // list heads, one per order
+  int nblock[MAXORDER+1];        // length of each list
+  // order of the free block starting at each page,
+  // or -1 if no free block starts there.
+  signed char order[NPAGE];
+  int nfragfail;   // kalloc_order() failures despite enough free pages
+} buddy;
+
+static void buddy_free(char *pa, int k);
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++){
+    snprintf(kmems[i].lockname, sizeof(kmems[i].lockname), "kmem_%d", i);
+    initlock(&kmems[i].lock, kmems[i].lockname);
+  }
+  initlock(&buddy.lock, "kmem_buddy");
+  for(int k = 0; k <= MAXORDER; k++)
+    buddy.free[k].next = buddy.free[k].prev = &buddy.free[k];
   freerange(end, (void*)PHYSTOP);
 }
 
+// Give the pages to the buddy allocator one at a time;
+// buddy_free() coalesces them into the largest blocks
+// that alignment allows. The per-CPU lists fill up
+// lazily on first use.
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+
+  buddy.base = (char*)PGROUNDUP((uint64)pa_start);
+  buddy.npage = ((char*)pa_end - buddy.base) / PGSIZE;
+  memset(buddy.order, -1, sizeof(buddy.order));
+  for(p = buddy.base; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+    buddy_free(p, 0);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
-void
-kfree(void *pa)
+static void
+block_remove(struct block *b)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+static void
+block_push(struct block *b, int k)
+{
+  b->next = buddy.free[k].next;
+  b->prev = &buddy.free[k];
+  buddy.free[k].next->prev = b;
+  buddy.free[k].next = b;
+  buddy.order[((char*)b - buddy.base) / PGSIZE] = k;
+  buddy.nblock[k]++;
+}
+
+// Allocate a block of 2^k pages, splitting a larger
+// block if necessary. Returns 0 if none is free.
+static char*
+buddy_alloc(int k)
+{
+  struct block *b;
+  int j, i;
+
+  acquire(&buddy.lock);
+  for(j = k; j <= MAXORDER; j++)
+    if(buddy.free[j].next != &buddy.free[j])
+      break;
+  if(j > MAXORDER){
+    release(&buddy.lock);
+    return 0;
+  }
+
+  b = buddy.free[j].next;
+  block_remove(b);
+  buddy.nblock[j]--;
+  i = ((char*)b - buddy.base) / PGSIZE;
+  buddy.order[i] = -1;
+
+  // return the upper halves of the block to the free lists.
+  while(j > k){
+    j--;
+    block_push((struct block*)((char*)b + ((uint64)PGSIZE << j)), j);
+  }
+  release(&buddy.lock);
+  return (char*)b;
+}
+
+// Free a block of 2^k pages, merging it with its buddy
+// for as long as the buddy is also free.
+static void
+buddy_free(char *pa, int k)
+{
+  int i, b;
+
+  if(((uint64)pa % PGSIZE) != 0 || pa < buddy.base || k < 0 || k > MAXORDER)
+    panic("kfree_order");
+  i = (pa - buddy.base) / PGSIZE;
+  if((i & ((1 << k) - 1)) != 0 || i + (1 << k) > buddy.npage)
+    panic("kfree_order");
+
+  acquire(&buddy.lock);
+  if(buddy.order[i] != -1)
+    panic("kfree_order: double free");
+  while(k < MAXORDER){
+    b = i ^ (1 << k);
+    if(b + (1 << k) > buddy.npage || buddy.order[b] != k)
+      break;
+    block_remove((struct block*)(buddy.base + (uint64)b * PGSIZE));
+    buddy.nblock[k]--;
+    buddy.order[b] = -1;
+    if(b < i)
+      i = b;
+    k++;
+  }
+  block_push((struct block*)(buddy.base + (uint64)i * PGSIZE), k);
+  release(&buddy.lock);
+}
+
+// Move up to NSTEAL pages from the head of CPU id's free
+// list back to the buddy allocator.
+static void
+kdrain(int id)
+{
+  struct run *r, *next;
+  int n;
+
+  acquire(&kmems[id].lock);
+  r = kmems[id].freelist;
+  for(n = 0; n < NSTEAL && kmems[id].freelist; n++)
+    kmems[id].freelist = kmems[id].freelist->next;
+  kmems[id].nfree -= n;
+  release(&kmems[id].lock);
+
+  for(; n > 0; n--, r = next){
+    next = r->next;
+    buddy_free((char*)r, 0);
+  }
+}
+
+// Push page pa onto CPU id's free list.
+static void
+kfree_cpu(void *pa, int id)
 {
   struct run *r;
+  int drain;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  if(kjunk)
+    memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  acquire(&kmems[id].lock);
+  r->next = kmems[id].freelist;
+  kmems[id].freelist = r;
+  kmems[id].nfree++;
+  drain = kmems[id].nfree > 2*NSTEAL;
+  release(&kmems[id].lock);
+
+  if(drain)
+    kdrain(id);
+}
+
+// Free the page of physical memory pointed at by v,
+// which normally should have been returned by a
+// call to kalloc().
+void
+kfree(void *pa)
+{
+  push_off();
+  kfree_cpu(pa, cpuid());
+  pop_off();
+}
+
+// Refill CPU id's free list from the buddy allocator.
+// Returns the number of pages added.
+static int
+krefill(int id)
+{
+  struct run *r;
+  char *pa;
+  int k, i;
+
+  for(k = NBATCHORDER; k >= 0; k--)
+    if((pa = buddy_alloc(k)) != 0)
+      break;
+  if(k < 0)
+    return 0;
+
+  acquire(&kmems[id].lock);
+  for(i = 0; i < (1 << k); i++){
+    r = (struct run*)(pa + (uint64)i * PGSIZE);
+    r->next = kmems[id].freelist;
+    kmems[id].freelist = r;
+  }
+  kmems[id].nfree += 1 << k;
+  release(&kmems[id].lock);
+  return 1 << k;
+}
+
+// Move up to NSTEAL pages from other CPUs' free lists
+// to CPU id's list. Only one lock is held at a time,
+// so two CPUs stealing from each other can't deadlock.
+// Returns the number of pages moved.
+static int
+ksteal(int id)
+{
+  struct run *head, *tail, **list;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    struct kmem *victim = &kmems[(id + i) % NCPU];
+
+    // racy peek, to avoid taking locks of empty lists.
+    if(victim->freelist == 0 && victim->zerolist == 0)
+      continue;
+
+    // take from the zero pool only when the victim
+    // has no other free pages.
+    acquire(&victim->lock);
+    list = victim->freelist ? &victim->freelist : &victim->zerolist;
+    head = tail = *list;
+    for(n = 0; n < NSTEAL && *list; n++){
+      tail = *list;
+      *list = tail->next;
+    }
+    if(list == &victim->freelist)
+      victim->nfree -= n;
+    else
+      victim->nzero -= n;
+    release(&victim->lock);
+
+    if(n > 0){
+      acquire(&kmems[id].lock);
+      tail->next = kmems[id].freelist;
+      kmems[id].freelist = head;
+      kmems[id].nfree += n;
+      release(&kmems[id].lock);
+      return n;
+    }
+  }
+  return 0;
+}
+
+// Pop a page from CPU id's lists, preferring the
+// zero pool if zeroed is set and the free list if not.
+// Sets *iszero if the page came from the zero pool.
+static struct run*
+kpop(int id, int zeroed, int *iszero)
+{
+  struct kmem *km = &kmems[id];
+  struct run *r;
+
+  acquire(&km->lock);
+  *iszero = 0;
+  if(zeroed && km->zerolist){
+    r = km->zerolist;
+    km->zerolist = r->next;
+    km->nzero--;
+    *iszero = 1;
+  } else if(km->freelist){
+    r = km->freelist;
+    km->freelist = r->next;
+    km->nfree--;
+  } else if((r = km->zerolist) != 0){
+    km->zerolist = r->next;
+    km->nzero--;
+    *iszero = 1;
+  }
+  release(&km->lock);
+  return r;
+}
+
+static void*
+kalloc1(int zeroed)
+{
+  struct run *r;
+  int id, iszero, reclaimed, n;
+
+  push_off();
+  id = cpuid();
+  reclaimed = 0;
+  for(;;){
+    r = kpop(id, zeroed, &iszero);
+    if(r)
+      break;
+    if(krefill(id) || ksteal(id))
+      continue;
+    // out of memory: shrink the buffer cache, the
+    // inode cache and the slab caches, once. ireclaim()
+    // goes first, since kmem_cache_reap() frees its pages.
+    if(reclaimed)
+      break;
+    n = breclaim(NSTEAL);
+    n += ireclaim();
+    if(n + kmem_cache_reap() == 0)
+      break;
+    reclaimed = 1;
+  }
+  pop_off();
+
+  if(r == 0)
+    return 0;
+  if(zeroed){
+    if(iszero)
+      r->next = 0;  // the only non-zero word of a pooled page
+    else
+      memset((char*)r, 0, PGSIZE);
+  } else if(kjunk){
+    memset((char*)r, 5, PGSIZE); // fill with junk
+  }
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// The contents of the page are undefined.
 void *
 kalloc(void)
 {
+  return kalloc1(0);
+}
+
+// Allocate one 4096-byte page of physical memory
+// filled with zeroes. Returns 0 if the memory
+// cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  return kalloc1(1);
+}
+
+// Return every page cached on the per-CPU lists
+// to the buddy allocator.
+static void
+kdrain_all(void)
+{
+  struct run *r, *next, *lists[2];
+
+  for(int id = 0; id < NCPU; id++){
+    acquire(&kmems[id].lock);
+    lists[0] = kmems[id].freelist;
+    lists[1] = kmems[id].zerolist;
+    kmems[id].freelist = kmems[id].zerolist = 0;
+    kmems[id].nfree = kmems[id].nzero = 0;
+    release(&kmems[id].lock);
+
+    for(int j = 0; j < 2; j++){
+      for(r = lists[j]; r; r = next){
+        next = r->next;
+        buddy_free((char*)r, 0);
+      }
+    }
+  }
+}
+
+// Allocate 2^order physically contiguous pages,
+// aligned to their size relative to the start of
+// free memory. Returns 0 if no such run is free.
+// Free with kfree_order() using the same order.
+void *
+kalloc_order(int order)
+{
+  char *pa;
+  int k, nfree;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
+  if((pa = buddy_alloc(order)) == 0){
+    // single pages cached by the CPUs may be
+    // what's keeping a large block from forming.
+    kdrain_all();
+    if((pa = buddy_alloc(order)) == 0){
+      acquire(&buddy.lock);
+      for(k = 0, nfree = 0; k <= MAXORDER; k++)
+        nfree += buddy.nblock[k] << k;
+      if(nfree >= (1 << order))
+        buddy.nfragfail++;
+      release(&buddy.lock);
+      return 0;
+    }
+  }
+
+  if(kjunk)
+    memset(pa, 5, (uint64)PGSIZE << order); // fill with junk
+  return pa;
+}
+
+// Free 2^order pages returned by kalloc_order(order).
+void
+kfree_order(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(kjunk)
+    memset(pa, 1, (uint64)PGSIZE << order);
+  buddy_free((char*)pa, order);
+}
+
+// Called by the scheduler when this CPU has nothing to
+// run: zero a few free pages and move them to the zero
+// pool, until the pool holds NZERO pages.
+void
+kzero_idle(void)
+{
+  struct kmem *km;
   struct run *r;
+  int i;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  for(i = 0; i < 8; i++){
+    push_off();
+    km = &kmems[cpuid()];
+    acquire(&km->lock);
+    r = 0;
+    if(km->nzero < NZERO && (r = km->freelist) != 0){
+      km->freelist = r->next;
+      km->nfree--;
+    }
+    release(&km->lock);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
-  return (void*)r;
+    if(r == 0){
+      pop_off();
+      break;
+    }
+    memset((char*)r, 0, PGSIZE);
+
+    acquire(&km->lock);
+    r->next = km->zerolist;
+    km->zerolist = r;
+    km->nzero++;
+    release(&km->lock);
+    pop_off();
+  }
+}
+
+// Number of free pages. Takes no locks, so the
+// answer is approximate.
+uint64
+kfreemem(void)
+{
+  uint64 n = 0;
+
+  for(int k = 0; k <= MAXORDER; k++)
+    n += (uint64)buddy.nblock[k] << k;
+  for(int id = 0; id < NCPU; id++)
+    n += kmems[id].nfree + kmems[id].nzero;
+  return n;
+}
+
+// Print free-memory statistics for the stats device.
+int
+statskmem(char *buf, int sz)
+{
+  int n, k, cached;
+
+  cached = 0;
+  for(k = 0; k < NCPU; k++)
+    cached += kmems[k].nfree + kmems[k].nzero;
+
+  acquire(&buddy.lock);
+  n = snprintf(buf, sz, "--- kalloc stats\n");
+  n += snprintf(buf+n, sz-n, "per-cpu cached pages: %d\n", cached);
+  for(k = 0; k <= MAXORDER; k++)
+    n += snprintf(buf+n, sz-n, "order %d: %d free\n", k, buddy.nblock[k]);
+  n += snprintf(buf+n, sz-n, "fragmentation failures: %d\n", buddy.nfragfail);
+  release(&buddy.lock);
+  return n;
 }
@@ -20,31 +20,120 @@
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
+// begin_op() reserves room in the transaction for
+// MAXOPBLOCKS blocks; a system call that knows it may write
+// more, or far fewer, says how many with begin_opn()/end_opn().
 //
-// The log is a physical re-do log containing disk blocks.
+// The log is a physical re-do journal containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
+//   journal super block, containing the sequence number
+//     of the first transaction in the journal
+//   transaction: descriptor block, containing a magic number,
+//     the sequence number, and block #s for block A, B, ...
+//     block A
+//     block B
+//     ...
+//   transaction: descriptor block ...
 //   ...
-// Log appends are synchronous.
+// A commit writes a transaction's blocks after the last one
+// in the journal, and then its descriptor, which is the true
+// point at which the transaction commits. Recovery replays
+// transactions from the start of the journal for as long as
+// their descriptors carry the expected sequence numbers.
+//
+// Committed blocks are checkpointed to their home locations
+// lazily: only when the next transaction doesn't fit in the
+// journal are the latest copies of all journaled blocks
+// installed, after which the journal starts over. A block
+// that several transactions in the journal wrote is installed
+// once. Until then its cache buffer stays pinned, since the
+// home location is out of date.
+//
+// In ordered-data mode (ORDERED in param.h), file data blocks
+// that writei() writes don't go through the journal: they are
+// recorded with log_write_data(), and commit() writes them to
+// their home locations before it writes the descriptor of the
+// transaction whose metadata points to them. A data block that
+// has a copy in the journal is journaled instead, so that
+// replaying the old copy can't overwrite newer data. So is a
+// block that the running transaction freed (log_free()): until
+// the transaction commits, the block still belongs to the file
+// that freed it, and writing it in place would change that
+// file's committed contents.
+//
+// Commits are pipelined. commit() first copies the committing
+// transaction's blocks and ordered data out of the buffer
+// cache, one buffer at a time, into private
+// staging buffers, with begin_op() held off. From then on a
+// new transaction can run while the staged copies are written
+// to the journal, so system calls don't stall for the disk
+// writes of a commit. Only one transaction commits at a time;
+// if the next one is complete by the time a commit finishes,
+// the committer commits it too.
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+#define LOGMAGIC 0x4c4f4721
+
+// Contents of a descriptor block, used for both the on-disk
+// descriptor and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint magic;
+  uint seq;
   int n;
   int block[LOGSIZE];
 };
 
+// Contents of the journal super block.
+struct logsuper {
+  uint seq;     // sequence number of the first transaction
+};
+
+// The journal holds transactions in the log blocks after
+// the journal super block: ring position p is disk block
+// log.start+1+p. The superblock says how many log blocks
+// there are, at most NLOGMAX, since every journaled block
+// keeps its cache buffer pinned; initlog() makes the buffer
+// cache big enough for them.
+#define NRING (NLOGMAX-1)
+#define RINGBLK(p) (log.start + 1 + (p))
+
+#define NFREED 32  // freed runs a transaction keeps track of
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks they have reserved in the transaction.
+  int committing;  // 1: commit() is copying, please wait.
+                   // 2: commit() is writing; new transactions may run.
   int dev;
-  struct logheader lh;
+  struct logheader lh;        // the running transaction
+  struct buf *lbuf[LOGSIZE];  // its blocks, pinned in the cache
+  int nd;
+  struct buf *dbuf[LOGSIZE];  // its ordered data blocks, pinned
+  int nf;                     // -1 if it freed too many runs to track
+  struct extent freed[NFREED];  // runs of blocks it freed
+
+  // the committing transaction.
+  struct logheader clh;
+  struct buf *cbuf[LOGSIZE];  // its blocks, pinned
+  int ncd;
+  struct buf *cdbuf[LOGSIZE]; // its ordered data blocks, pinned
+  int ncf;
+  struct extent cfreed[NFREED];
+  struct buf dstage[LOGSIZE]; // private copies of its ordered data,
+                              // made before cdbuf[] is unpinned
+
+  // the journal, used by commit() only.
+  int nring;                  // ring positions in use
+  uint seq;                   // sequence number of the next commit
+  int head;                   // ring position of the next commit
+  struct buf stage[NRING];    // private copies of the journal's blocks
+  uint home[NRING];           // block # of each ring position's block
+  struct buf *pin[NRING];     // its cache buffer, or 0 if a later
+                              // copy of the block is in the journal
+  struct buf *iob[NRING];     // scratch, to keep kernel stacks small
+  int pos[NRING];
 };
 struct log log;
 
@@ -54,61 +143,75 @@ static void commit();
 void
 initlog(int dev, struct superblock *sb)
 {
+  char *pa = 0;
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog < LOGSIZE+2)
+    panic("initlog: log too small");
+  if (sb->nlog > NLOGMAX)
+    panic("initlog: log too big");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.nring = sb->nlog - 1;
+  // the journal's pinned buffers, and the running
+  // transaction's, must fit in the cache with room to spare.
+  breserve(sb->nlog + LOGSIZE + 2*MAXOPBLOCKS);
+  for (i = 0; i < log.nring; i++) {
+    if (i % (PGSIZE/BSIZE) == 0 && (pa = kalloc()) == 0)
+      panic("initlog: kalloc");
+    log.stage[i].dev = dev;
+    log.stage[i].data = (uchar*)pa + (i % (PGSIZE/BSIZE)) * BSIZE;
+  }
+  for (i = 0; i < LOGSIZE; i++) {
+    if (i % (PGSIZE/BSIZE) == 0 && (pa = kalloc()) == 0)
+      panic("initlog: kalloc");
+    log.dstage[i].dev = dev;
+    log.dstage[i].data = (uchar*)pa + (i % (PGSIZE/BSIZE)) * BSIZE;
+  }
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Read or write the n staging buffers in bufs[] from or
+// to the disk blocks their blockno fields say, all at once.
 static void
-install_trans(int recovering)
+stage_rw(struct buf **bufs, int n, int write)
 {
-  int tail;
+  int i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+  for (i = 0; i < n; )
+    i += virtio_disk_submit(bufs + i, n - i, write, 0, 0);
+  for (i = 0; i < n; i++)
+    virtio_disk_wait(bufs[i]);
 }
 
-// Read the log header from disk into the in-memory log header
+// Write the staging buffers at ring positions pos[0..n-1] to
+// their home locations. They are written in block number
+// order, so that the disk can merge adjacent ones.
 static void
-read_head(void)
+install(int *pos, int n)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  struct buf **b = log.iob;
+  int i, j;
+
+  for (i = 0; i < n; i++) {   // insertion sort
+    for (j = i; j > 0 && b[j-1]->blockno > log.home[pos[i]]; j--)
+      b[j] = b[j-1];
+    b[j] = &log.stage[pos[i]];
+    b[j]->blockno = log.home[pos[i]];
   }
-  brelse(buf);
+  stage_rw(b, n, 1);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
 static void
-write_head(void)
+write_super(uint seq)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
+  ((struct logsuper *) (buf->data))->seq = seq;
   bwrite(buf);
   brelse(buf);
 }
@@ -116,43 +219,88 @@ write_head(void)
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct buf *buf, **b = log.iob;
+  struct logheader *d;
+  int *pos = log.pos;
+  int p, i;
+  uint seq;
+
+  buf = bread(log.dev, log.start);
+  seq = ((struct logsuper *) (buf->data))->seq;
+  brelse(buf);
+
+  // replay the committed transactions, in order.
+  for (p = 0; p < log.nring; p += 1 + d->n, seq++) {
+    b[0] = &log.stage[p];
+    b[0]->blockno = RINGBLK(p);
+    stage_rw(b, 1, 0);
+    d = (struct logheader *) log.stage[p].data;
+    if (d->magic != LOGMAGIC || d->seq != seq ||
+        d->n < 0 || d->n > LOGSIZE || p + 1 + d->n > log.nring)
+      break;
+    for (i = 0; i < d->n; i++) {
+      pos[i] = p + 1 + i;
+      log.home[pos[i]] = d->block[i];
+      b[i] = &log.stage[pos[i]];
+      b[i]->blockno = RINGBLK(pos[i]);
+    }
+    stage_rw(b, d->n, 0);  // read the transaction's blocks
+    install(pos, d->n);    // and copy them to disk
+  }
+
+  // start an empty journal.
+  log.seq = seq;
+  log.head = 0;
+  write_super(seq);
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call that
+// writes at most n blocks.
 void
-begin_op(void)
+begin_opn(int n)
 {
+  if(n > LOGSIZE)
+    panic("begin_opn");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.committing == 1){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.nd + log.reserved + n > LOGSIZE){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the start of each FS system call.
 void
-end_op(void)
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the end of each FS system call, with the
+// n given to begin_opn().
+// commits if this was the last outstanding operation,
+// unless an earlier transaction is still committing;
+// its committer will commit this one next.
+void
+end_opn(int n)
 {
   int do_commit = 0;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
+  log.reserved -= n;
+  if(log.committing == 1)
     panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.outstanding == 0 && log.committing == 0 && log.lh.n + log.nd > 0){
     do_commit = 1;
     log.committing = 1;
   } else {
@@ -167,39 +315,198 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// Install the latest copy of every block in the journal at
+// its home location, and empty the journal.
+static void
+checkpoint(void)
+{
+  int *pos = log.pos;
+  int p, n;
+
+  n = 0;
+  for (p = 0; p < log.head; p++)
+    if (log.pin[p])
+      pos[n++] = p;
+  install(pos, n);
+  // the journal's transactions must not be replayed
+  // over blocks changed after this point.
+  write_super(log.seq);
+
+  acquire(&log.lock);  // for log_write_data()
+  for (p = 0; p < log.head; p++) {
+    if (log.pin[p]) {
+      bunpin(log.pin[p]);
+      log.pin[p] = 0;
+    }
+  }
+  log.head = 0;
+  release(&log.lock);
+}
+
+// Copy modified blocks from cache to the staging buffers
+// after the committing transaction's descriptor.
+static void
+stage_trans(void)
+{
+  int i;
+
+  for (i = 0; i < log.clh.n; i++) {
+    struct buf *from = log.cbuf[i];  // cache block, pinned
+    acquiresleep(&from->lock);
+    memmove(log.stage[log.head+1+i].data, from->data, BSIZE);
+    releasesleep(&from->lock);
+  }
+}
+
+// Copy the committing transaction's ordered data blocks out
+// of the cache, with only one buffer locked at a time, and
+// unpin them. Like stage_trans(), this runs before the next
+// transaction may start, so that none of its operations can
+// free a block and write its new owner's data over the copy.
+static void
+stage_data(void)
+{
+  int i;
+
+  for (i = 0; i < log.ncd; i++) {
+    struct buf *from = log.cdbuf[i];
+    acquiresleep(&from->lock);
+    memmove(log.dstage[i].data, from->data, BSIZE);
+    log.dstage[i].blockno = from->blockno;
+    releasesleep(&from->lock);
+    bunpin(from);
+  }
+}
+
+// Write the staged ordered data blocks to their home
+// locations, in block number order.
+static void
+write_data(void)
+{
+  struct buf **b = log.iob;
+  int i, j;
+
+  for (i = 0; i < log.ncd; i++) {   // insertion sort
+    for (j = i; j > 0 && b[j-1]->blockno > log.dstage[i].blockno; j--)
+      b[j] = b[j-1];
+    b[j] = &log.dstage[i];
+  }
+  stage_rw(b, log.ncd, 1);
+}
+
+// Write the committing transaction to the journal: first its
+// ordered data and its blocks, then its descriptor, which
+// commits it.
 static void
 write_log(void)
 {
-  int tail;
+  struct buf **b = log.iob;
+  struct logheader *d;
+  int i, p;
+
+  write_data();
+  if (log.clh.n == 0)
+    return;
+
+  for (i = 0; i < log.clh.n; i++) {
+    p = log.head + 1 + i;
+    b[i] = &log.stage[p];
+    b[i]->blockno = RINGBLK(p);
+  }
+  stage_rw(b, log.clh.n, 1);
+
+  b[0] = &log.stage[log.head];
+  b[0]->blockno = RINGBLK(log.head);
+  d = (struct logheader *) b[0]->data;
+  *d = log.clh;
+  d->magic = LOGMAGIC;
+  d->seq = log.seq;
+  stage_rw(b, 1, 1);
+}
+
+// Record the committed transaction's blocks in the journal.
+// An earlier copy of a block needn't be installed any more,
+// so it gives up its pin.
+static void
+journal_trans(void)
+{
+  int i, p, q;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  if (log.clh.n == 0)
+    return;
+  acquire(&log.lock);  // for log_write_data()
+  log.home[log.head] = 0;  // the descriptor
+  log.pin[log.head] = 0;
+  for (i = 0; i < log.clh.n; i++) {
+    p = log.head + 1 + i;
+    for (q = 0; q < log.head; q++) {
+      if (log.pin[q] && log.home[q] == log.clh.block[i]) {
+        bunpin(log.pin[q]);
+        log.pin[q] = 0;
+      }
+    }
+    log.home[p] = log.clh.block[i];
+    log.pin[p] = log.cbuf[i];
   }
+  log.head += 1 + log.clh.n;
+  log.seq++;
+  release(&log.lock);
 }
 
+// Commit the running transaction, which has no outstanding
+// operations, and then any that completes meanwhile.
+// Called with log.committing set to 1.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  acquire(&log.lock);
+  while (log.lh.n + log.nd > 0) {
+    // take over the running transaction.
+    log.clh = log.lh;
+    memmove(log.cbuf, log.lbuf, log.lh.n * sizeof(log.lbuf[0]));
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.ncd = log.nd;
+    memmove(log.cdbuf, log.dbuf, log.nd * sizeof(log.dbuf[0]));
+    log.nd = 0;
+    log.ncf = log.nf;
+    if (log.nf > 0)
+      memmove(log.cfreed, log.freed, log.nf * sizeof(log.freed[0]));
+    log.nf = 0;
+    release(&log.lock);
+
+    if (log.head + 1 + log.clh.n > log.nring)
+      checkpoint();  // make room
+    stage_trans();   // Copy modified blocks out of the cache
+    stage_data();    // and ordered data
+
+    acquire(&log.lock);
+    log.committing = 2;
+    wakeup(&log);    // the next transaction may start
+    release(&log.lock);
+
+    write_log();     // Write data, and staged blocks to the journal -- the real commit
+    journal_trans();
+
+    acquire(&log.lock);
+    log.clh.n = 0;
+    log.ncd = 0;
+    log.ncf = 0;
+    if (log.outstanding > 0)
+      break;  // its last end_op() will commit the running transaction
+    log.committing = 1;
   }
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -216,7 +523,7 @@ log_write(struct buf *b)
 {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= LOGSIZE)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -229,8 +536,117 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    log.lbuf[i] = b;
     log.lh.n++;
   }
   release(&log.lock);
 }
 
+// Did the n runs of blocks in f, or n < 0 runs, include b?
+static int
+wasfreed(struct extent *f, int n, uint b)
+{
+  int i;
+
+  if (n < 0)
+    return 1;
+  for (i = 0; i < n; i++)
+    if (b >= f[i].start && b < f[i].start + f[i].len)
+      return 1;
+  return 0;
+}
+
+// Like log_write(), for a block of file data, which in
+// ordered-data mode commit() writes in place instead of
+// journaling it. Caller holds b's lock.
+void
+log_write_data(struct buf *b)
+{
+  int i, p;
+
+  if (!ORDERED) {
+    log_write(b);
+    return;
+  }
+  if (log.outstanding < 1)
+    panic("log_write_data outside of trans");
+
+  acquire(&log.lock);
+  // a copy in the journal, or on its way there, would be
+  // replayed over the data after a crash; journal it too.
+  for (i = 0; i < log.clh.n; i++)
+    if (log.clh.block[i] == b->blockno)
+      goto journal;
+  for (p = 0; p < log.head; p++)
+    if (log.home[p] == b->blockno)
+      goto journal;
+  // so would writing over a block freed by a transaction that
+  // hasn't committed.
+  if (wasfreed(log.freed, log.nf, b->blockno) ||
+      wasfreed(log.cfreed, log.ncf, b->blockno))
+    goto journal;
+
+  for (i = 0; i < log.nd; i++)
+    if (log.dbuf[i] == b)
+      break;
+  if (i == log.nd) {
+    if (log.lh.n + log.nd >= LOGSIZE)
+      panic("too big a transaction");
+    bpin(b);
+    log.dbuf[log.nd++] = b;
+  }
+  // drop it from the journaled blocks, where bzero() put it
+  // when the block was allocated by this transaction.
+  for (i = 0; i < log.lh.n; i++) {
+    if (log.lh.block[i] == b->blockno) {
+      bunpin(log.lbuf[i]);
+      log.lh.n--;
+      log.lh.block[i] = log.lh.block[log.lh.n];
+      log.lbuf[i] = log.lbuf[log.lh.n];
+      break;
+    }
+  }
+  release(&log.lock);
+  return;
+
+journal:
+  release(&log.lock);
+  log_write(b);
+}
+
+// Record that the running transaction frees blocks b..b+n-1.
+// Their ordered data needn't be written any more, and any
+// data written to them before the transaction commits must
+// be journaled.
+void
+log_free(uint b, uint n)
+{
+  struct extent *f;
+  int i;
+
+  if (!ORDERED)
+    return;
+  if (log.outstanding < 1)
+    panic("log_free outside of trans");
+
+  acquire(&log.lock);
+  for (i = 0; i < log.nd; ) {
+    if (log.dbuf[i]->blockno >= b && log.dbuf[i]->blockno < b + n) {
+      bunpin(log.dbuf[i]);
+      log.dbuf[i] = log.dbuf[--log.nd];
+    } else {
+      i++;
+    }
+  }
+  f = &log.freed[log.nf > 0 ? log.nf-1 : 0];
+  if (log.nf > 0 && f->start + f->len == b) {
+    f->len += n;
+  } else if (log.nf == NFREED) {
+    log.nf = -1;  // journal all data until the commit
+  } else if (log.nf >= 0) {
+    log.freed[log.nf].start = b;
+    log.freed[log.nf].len = n;
+    log.nf++;
+  }
+  release(&log.lock);
+}
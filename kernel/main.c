@@ -29,7 +29,9 @@ main()
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode cache
+    dcacheinit();    // directory name cache
     fileinit();      // file table
+    pipeinit();      // pipe allocator
     virtio_disk_init(); // emulated hard disk
 #ifdef LAB_NET
     pci_init();
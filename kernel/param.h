@@ -2,12 +2,27 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // in-memory i-nodes always allowed
+#define NINODEMAX   200  // most in-memory i-nodes while memory is plentiful
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       10000  // size of file system in blocks
+#define MAXOPBLOCKS  10  // max # of blocks an FS op writes, unless it says (begin_opn())
+#define LOGSIZE      64  // max data blocks in a log transaction
+#define NLOG         (2*LOGSIZE+1)  // default on-disk log size (mkfs -l)
+#define NBUF         (NLOG+LOGSIZE+2*MAXOPBLOCKS)  // initial size of disk block cache
+#define NBUFMAX      512  // maximum size of disk block cache
+#define NLOGMAX      (NBUFMAX-LOGSIZE-2*MAXOPBLOCKS)  // largest on-disk log the kernel can use
+#define NDELAY       4  // blocks of a file that may wait for disk blocks (<= a page)
+#define NREADAHEAD   8  // max blocks read ahead of a sequential reader
+#define FSSIZE       70000  // size of file system in blocks; room for one MAXFILE file
 #define MAXPATH      128   // maximum file path name
+#ifndef KJUNK
+#define KJUNK        0  // junk-fill pages in kalloc()/kfree() (make KJUNK=1)
+#endif
+#ifndef ORDERED
+#define ORDERED      1  // write file data in place, not via the log (make ORDERED=0)
+#endif
+#ifndef DISKPOLL
+#define DISKPOLL     0  // poll for single-block disk requests (make DISKPOLL=1)
+#endif
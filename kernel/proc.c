@@ -465,6 +465,7 @@ scheduler(void)
     intr_on();
     
     int nproc = 0;
+    int found = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
       if(p->state != UNUSED) {
@@ -476,6 +477,7 @@ scheduler(void)
         // before jumping back to us.
         p->state = RUNNING;
         c->proc = p;
+        found = 1;
         swtch(&c->context, &p->context);
 
         // Process is done running for now.
@@ -484,6 +486,8 @@ scheduler(void)
       }
       release(&p->lock);
     }
+    if(found == 0)
+      kzero_idle();  // nothing to run; refill the zero-page pool
     if(nproc <= 2) {   // only init and sh exist
       intr_on();
       asm volatile("wfi");
@@ -0,0 +1,242 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// A kmem_cache hands out objects of a single size. Objects
+// are carved out of pages (slabs) obtained from kalloc();
+// each slab starts with a struct slab header, followed by
+// as many objects as fit in the rest of the page.
+//
+// Each CPU keeps a magazine of free objects for each cache,
+// so the common kmem_cache_alloc() and kmem_cache_free()
+// paths only take the CPU's own magazine lock, which nobody
+// else takes except kmem_cache_reap(). An empty magazine is
+// refilled, and a full one is flushed, half a magazine at a
+// time under the cache's lock.
+//
+// Lock order: magazine lock, then cache lock. kalloc() is
+// never called with either held, because kalloc() may call
+// kmem_cache_reap() when memory runs out.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "slab.h"
+#include "defs.h"
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;   // partial list
+  struct slab *prev;
+  void *free;          // free objects, linked through their first word
+  int inuse;           // objects handed out from this slab
+};
+
+// all caches, for kmem_cache_reap(). caches are
+// created at boot and never destroyed.
+static struct kmem_cache *caches;
+
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  c->nperslab = (PGSIZE - sizeof(struct slab)) / c->size;
+  if(c->nperslab < 1)
+    panic("kmem_cache_init");
+  c->partial = 0;
+  initlock(&c->lock, name);
+  for(int i = 0; i < NCPU; i++){
+    initlock(&c->mag[i].lock, "magazine");
+    c->mag[i].n = 0;
+  }
+  c->next = caches;
+  caches = c;
+}
+
+static void
+partial_insert(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+static void
+partial_remove(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Turn page into a slab and put it on c's partial list.
+// Caller must hold c->lock.
+static void
+slab_add(struct kmem_cache *c, void *page)
+{
+  struct slab *s = (struct slab*)page;
+  char *obj;
+  int i;
+
+  s->cache = c;
+  s->free = 0;
+  s->inuse = 0;
+  for(i = c->nperslab - 1; i >= 0; i--){
+    obj = (char*)(s + 1) + i * c->size;
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  partial_insert(c, s);
+}
+
+// Move up to n free objects from c's slabs into buf.
+// Returns the number of objects moved.
+// Caller must hold c->lock.
+static int
+slab_take(struct kmem_cache *c, void **buf, int n)
+{
+  struct slab *s;
+  void *obj;
+  int got;
+
+  for(got = 0; got < n; ){
+    if((s = c->partial) == 0)
+      break;
+    while(got < n && s->free){
+      obj = s->free;
+      s->free = *(void**)obj;
+      s->inuse++;
+      buf[got++] = obj;
+    }
+    if(s->free == 0)
+      partial_remove(c, s);
+  }
+  return got;
+}
+
+// Return obj to its slab, freeing the slab's page if
+// it is now unused and isn't c's only partial slab.
+// Returns 1 if it freed the page.
+// Caller must hold c->lock.
+static int
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint64)obj);
+  if(s->cache != c || s->inuse < 1)
+    panic("kmem_cache_free");
+  if(s->free == 0)
+    partial_insert(c, s);  // was full
+  *(void**)obj = s->free;
+  s->free = obj;
+  s->inuse--;
+  if(s->inuse == 0 && (c->partial != s || s->next != 0)){
+    partial_remove(c, s);
+    kfree((void*)s);
+    return 1;
+  }
+  return 0;
+}
+
+// Allocate an object from cache c.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj, *page;
+
+  page = 0;
+  for(;;){
+    push_off();
+    m = &c->mag[cpuid()];
+    acquire(&m->lock);
+    if(m->n == 0){
+      acquire(&c->lock);
+      if(page){
+        slab_add(c, page);
+        page = 0;
+      }
+      m->n = slab_take(c, m->obj, MAGSIZE/2);
+      release(&c->lock);
+    }
+    obj = 0;
+    if(m->n > 0)
+      obj = m->obj[--m->n];
+    release(&m->lock);
+    pop_off();
+
+    if(obj)
+      break;
+    // no free objects: get a page for a new slab.
+    if((page = kalloc()) == 0)
+      return 0;
+  }
+
+  if(page)
+    kfree(page);  // someone freed an object meanwhile
+  return obj;
+}
+
+// Free an object that was allocated from cache c.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slab_put(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  release(&m->lock);
+  pop_off();
+}
+
+// Empty every CPU's magazines and give unused slab pages
+// back to kalloc(). Called by kalloc() when it runs out
+// of memory. Returns the number of pages freed.
+int
+kmem_cache_reap(void)
+{
+  struct kmem_cache *c;
+  struct magazine *m;
+  struct slab *s, *next;
+  int freed = 0;
+
+  for(c = caches; c; c = c->next){
+    for(m = c->mag; m < c->mag + NCPU; m++){
+      acquire(&m->lock);
+      acquire(&c->lock);
+      while(m->n > 0)
+        freed += slab_put(c, m->obj[--m->n]);
+      release(&c->lock);
+      release(&m->lock);
+    }
+
+    // slab_put() keeps one empty slab; free it too.
+    acquire(&c->lock);
+    for(s = c->partial; s; s = next){
+      next = s->next;
+      if(s->inuse == 0){
+        partial_remove(c, s);
+        kfree((void*)s);
+        freed++;
+      }
+    }
+    release(&c->lock);
+  }
+  return freed;
+}
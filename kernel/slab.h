@@ -0,0 +1,20 @@
+// Caches of fixed-size kernel objects; see slab.c.
+
+#define MAGSIZE 16  // objects per per-CPU magazine
+
+// A per-CPU stack of free objects.
+struct magazine {
+  struct spinlock lock;      // only contended by kmem_cache_reap()
+  int n;                     // number of objects in obj[]
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;                 // object size, rounded up to 8 bytes
+  int nperslab;              // objects per slab page
+  struct spinlock lock;      // protects partial and the slabs on it
+  struct slab *partial;      // slabs with at least one free object
+  struct magazine mag[NCPU]; // indexed by cpuid()
+  struct kmem_cache *next;   // list of all caches
+};
@@ -9,7 +9,7 @@
 #include "defs.h"
 
 #ifdef LAB_LOCK
-#define NLOCK 500
+#define NLOCK 1500
 
 static struct spinlock *locks[NLOCK];
 struct spinlock lock_locks;
@@ -183,7 +183,10 @@ statslock(char *buf, int sz) {
     if(strncmp(locks[i]->name, "bcache", strlen("bcache")) == 0 ||
        strncmp(locks[i]->name, "kmem", strlen("kmem")) == 0) {
       tot += locks[i]->nts;
-      n += snprint_lock(buf +n, sz-n, locks[i]);
+      // there are hundreds of bcache locks; list only
+      // contended ones so the report fits in buf.
+      if(locks[i]->nts > 0)
+        n += snprint_lock(buf +n, sz-n, locks[i]);
     }
   }
   
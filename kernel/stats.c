@@ -19,6 +19,10 @@ static struct {
 
 int statscopyin(char*, int);
 int statslock(char*, int);
+int statskmem(char*, int);
+int statsbcache(char*, int);
+int statsdisk(char*, int);
+int statsdcache(char*, int);
   
 int
 statswrite(int user_src, uint64 src, int n)
@@ -39,6 +43,10 @@ statsread(int user_dst, uint64 dst, int n)
 #endif
 #ifdef LAB_LOCK
     stats.sz = statslock(stats.buf, BUFSZ);
+    stats.sz += statskmem(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statsbcache(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statsdisk(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statsdcache(stats.buf+stats.sz, BUFSZ-stats.sz);
 #endif
   }
   m = stats.sz - stats.off;
@@ -16,6 +16,13 @@
 #include "file.h"
 #include "fcntl.h"
 
+// System calls that add a directory entry reserve room for
+// dirlink() to hash the directory or split its leaves.
+#define LINKOPBLOCKS (MAXOPBLOCKS + DIRLINKBLOCKS)
+
+// System calls that may free a file reserve room for itrunc().
+#define UNLINKOPBLOCKS (MAXOPBLOCKS + ITRUNCBLOCKS)
+
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
 static int
@@ -125,16 +132,16 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(LINKOPBLOCKS);
   if((ip = namei(old)) == 0){
-    end_op();
+    end_opn(LINKOPBLOCKS);
     return -1;
   }
 
   ilock(ip);
   if(ip->type == T_DIR){
     iunlockput(ip);
-    end_op();
+    end_opn(LINKOPBLOCKS);
     return -1;
   }
 
@@ -152,7 +159,7 @@ sys_link(void)
   iunlockput(dp);
   iput(ip);
 
-  end_op();
+  end_opn(LINKOPBLOCKS);
 
   return 0;
 
@@ -161,7 +168,7 @@ bad:
   ip->nlink--;
   iupdate(ip);
   iunlockput(ip);
-  end_op();
+  end_opn(LINKOPBLOCKS);
   return -1;
 }
 
@@ -172,10 +179,11 @@ isdirempty(struct inode *dp)
   int off;
   struct dirent de;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+  // a hashed directory has "." and ".." anywhere.
+  for(off=0; off<dp->size; off+=sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if(de.inum != 0)
+    if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0)
       return 0;
   }
   return 1;
@@ -192,9 +200,9 @@ sys_unlink(void)
   if(argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(UNLINKOPBLOCKS);
   if((dp = nameiparent(path, name)) == 0){
-    end_op();
+    end_opn(UNLINKOPBLOCKS);
     return -1;
   }
 
@@ -218,6 +226,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_enter(dp->dev, dp->inum, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -228,13 +237,13 @@ sys_unlink(void)
   iupdate(ip);
   iunlockput(ip);
 
-  end_op();
+  end_opn(UNLINKOPBLOCKS);
 
   return 0;
 
 bad:
   iunlockput(dp);
-  end_op();
+  end_opn(UNLINKOPBLOCKS);
   return -1;
 }
 
@@ -290,35 +299,38 @@ sys_open(void)
   int fd, omode;
   struct file *f;
   struct inode *ip;
-  int n;
+  int n, nop;
 
   if((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  begin_op();
+  nop = (omode & O_CREATE) ? LINKOPBLOCKS : MAXOPBLOCKS;
+  if(omode & O_TRUNC)
+    nop += ITRUNCBLOCKS;
+  begin_opn(nop);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
     if(ip == 0){
-      end_op();
+      end_opn(nop);
       return -1;
     }
   } else {
     if((ip = namei(path)) == 0){
-      end_op();
+      end_opn(nop);
       return -1;
     }
     ilock(ip);
     if(ip->type == T_DIR && omode != O_RDONLY){
       iunlockput(ip);
-      end_op();
+      end_opn(nop);
       return -1;
     }
   }
 
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
     iunlockput(ip);
-    end_op();
+    end_opn(nop);
     return -1;
   }
 
@@ -326,7 +338,7 @@ sys_open(void)
     if(f)
       fileclose(f);
     iunlockput(ip);
-    end_op();
+    end_opn(nop);
     return -1;
   }
 
@@ -346,7 +358,7 @@ sys_open(void)
   }
 
   iunlock(ip);
-  end_op();
+  end_opn(nop);
 
   return fd;
 }
@@ -357,13 +369,13 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_opn(LINKOPBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
-    end_op();
+    end_opn(LINKOPBLOCKS);
     return -1;
   }
   iunlockput(ip);
-  end_op();
+  end_opn(LINKOPBLOCKS);
   return 0;
 }
 
@@ -374,16 +386,16 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_opn(LINKOPBLOCKS);
   if((argstr(0, path, MAXPATH)) < 0 ||
      argint(1, &major) < 0 ||
      argint(2, &minor) < 0 ||
      (ip = create(path, T_DEVICE, major, minor)) == 0){
-    end_op();
+    end_opn(LINKOPBLOCKS);
     return -1;
   }
   iunlockput(ip);
-  end_op();
+  end_opn(LINKOPBLOCKS);
   return 0;
 }
 
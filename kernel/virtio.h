@@ -45,7 +45,10 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 32
+
+// most blocks in one scatter-gather request.
+#define NSG 8
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -59,11 +62,12 @@ struct virtq_desc {
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_AVAIL_F_NO_INTERRUPT, or zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // with EVENT_IDX: interrupt when used idx passes this
 };
+#define VRING_AVAIL_F_NO_INTERRUPT 1 // driver doesn't want interrupts
 
 // one entry in the "used" ring, with which the
 // device tells the driver about completed requests.
@@ -73,10 +77,12 @@ struct virtq_used_elem {
 };
 
 struct virtq_used {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_USED_F_NO_NOTIFY, or zero
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // with EVENT_IDX: notify when avail idx passes this
 };
+#define VRING_USED_F_NO_NOTIFY 1 // device doesn't want notifications
 
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
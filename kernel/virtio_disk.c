@@ -20,6 +20,12 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// times virtio_disk_poll() looks at the used ring before
+// it gives up and sleeps.
+#define POLLSPIN 10000
+
+int diskpoll = DISKPOLL;
+
 static struct disk {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
@@ -56,13 +62,27 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 notified_idx; // avail->idx at the last notify.
+  int event_idx;   // was VIRTIO_RING_F_EVENT_IDX negotiated?
+  int intr_on;     // did we last ask for interrupts?
+  int npoll;       // processes in virtio_disk_poll()
+
+  // statistics.
+  uint nreq;       // requests, each of one or more blocks
+  uint nblocks;
+  uint nnotify;    // notifications sent to the device
+  uint nintr;      // interrupts taken
+  uint npolled;    // requests finished by virtio_disk_poll()
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // status and done are indexed by first descriptor index
+  // of chain, b by the index of the buf's data descriptor.
   struct {
     struct buf *b;
     char status;
+    void (*done)(struct buf *);  // if set, called on completion
+    char wake;   // last request of a batch a process waits for
   } info[NUM];
 
   // disk command headers.
@@ -100,9 +120,12 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  // keep EVENT_IDX, if offered, to cut down on
+  // notifications and interrupts.
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
+  disk.intr_on = 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -184,12 +207,13 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// a disk transfer uses one for the header, one per block,
+// and one for the status.
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -200,27 +224,76 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// tell the device to look at the avail ring, unless it
+// has said it doesn't need to be told: with EVENT_IDX, if
+// avail_event isn't among the entries added since the last
+// notify; otherwise if it has set VRING_USED_F_NO_NOTIFY.
+static void
+virtio_disk_notify(void)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint16 old = disk.notified_idx;
+  uint16 new = disk.avail->idx;
+  int need;
 
-  acquire(&disk.vdisk_lock);
+  __sync_synchronize();
+  if(disk.event_idx)
+    need = (uint16)(new - disk.used->avail_event - 1) < (uint16)(new - old);
+  else
+    need = !(disk.used->flags & VRING_USED_F_NO_NOTIFY);
+  disk.notified_idx = new;
+  if(need){
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+    disk.nnotify++;
+  }
+}
+
+// the used ring index to interrupt at, for the requests in
+// flight up to avail ring index end: that of the first one
+// ending a batch that a process sleeps on, so that it isn't
+// kept waiting for requests queued behind it, or else that of
+// the last one, so that one interrupt covers every
+// read-ahead. requests mostly finish in order.
+static uint16
+intr_target(uint16 end)
+{
+  uint16 i;
+
+  for(i = disk.used_idx; i != end; i++)
+    if(disk.info[disk.avail->ring[i % NUM]].wake)
+      return i;
+  return end - 1;
+}
+
+// put a request to read or write the n buffers in bufs[],
+// which hold consecutive blocks, in the avail ring. the
+// device is told about it by the next notify.
+// returns 0 if nowait is set and no descriptors are free.
+// caller must hold vdisk_lock.
+static int
+virtio_disk_start(struct buf **bufs, int n, int write,
+                  void (*done)(struct buf *), int wake, int nowait)
+{
+  uint64 sector = bufs[0]->blockno * (BSIZE / 512);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, then descriptors
+  // for the data, then one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[NSG+2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(allocn_desc(idx, n+2) == 0) {
       break;
     }
+    if(nowait)
+      return 0;
+    // let the device get on with requests already in
+    // the ring, so that descriptors are freed.
+    virtio_disk_notify();
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -237,45 +310,202 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 0; i < n; i++){
+    int d = idx[i+1];
+    disk.desc[d].addr = (uint64) bufs[i]->data;
+    disk.desc[d].len = BSIZE;
+    if(write)
+      disk.desc[d].flags = 0; // device reads b->data
+    else
+      disk.desc[d].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[d].flags |= VRING_DESC_F_NEXT;
+    disk.desc[d].next = idx[i+2];
+
+    // record struct buf for virtio_disk_intr().
+    bufs[i]->disk = 1;
+    disk.info[d].b = bufs[i];
+  }
 
+  int s = idx[n+1];
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[s].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[s].len = 1;
+  disk.desc[s].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[s].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.info[idx[0]].done = done;
+  disk.info[idx[0]].wake = wake;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
 
+  // before the device can see the request, and finish it,
+  // ask for the interrupt it may need.
+  if(disk.event_idx && disk.intr_on)
+    disk.avail->used_event = intr_target(disk.avail->idx + 1);
+
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
 
-  __sync_synchronize();
+  disk.nreq++;
+  disk.nblocks += n;
+  return 1;
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// start reading (or writing) the n buffers in bufs[], and
+// return without waiting for them. runs of buffers holding
+// consecutive blocks, up to NSG long, are merged into one
+// scatter-gather request, and the device is notified once
+// for the whole batch. a buffer's b->disk stays 1 until its
+// request is finished; then virtio_disk_intr() calls done(b),
+// if done is set, or else wakes virtio_disk_wait().
+// if all descriptors are in use, wait for some to be freed,
+// or, if nowait is set, stop.
+// returns the number of buffers submitted.
+int
+virtio_disk_submit(struct buf **bufs, int n, int write,
+                   void (*done)(struct buf *), int nowait)
+{
+  int i, k;
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  acquire(&disk.vdisk_lock);
+  for(i = 0; i < n; i += k){
+    for(k = 1; i + k < n && k < NSG; k++)
+      if(bufs[i+k]->dev != bufs[i]->dev ||
+         bufs[i+k]->blockno != bufs[i]->blockno + k)
+        break;
+    if(virtio_disk_start(bufs + i, k, write, done, done == 0 && i + k == n, nowait) == 0)
+      break;
+  }
+  if(i > 0)
+    virtio_disk_notify();
+  release(&disk.vdisk_lock);
+  return i;
+}
+
+// wait for a request submitted without a done function.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
+  release(&disk.vdisk_lock);
+}
+
+static void virtio_disk_poll(struct buf *);
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(&b, 1, write, 0, 0);
+  if(diskpoll)
+    virtio_disk_poll(b);
+  else
+    virtio_disk_wait(b);
+}
+
+// tell the device whether to interrupt when it finishes
+// requests. with EVENT_IDX, used_event is the used ring
+// index whose filling should interrupt (see intr_target());
+// setting it just behind the current index means never.
+static void
+virtio_disk_intr_enable(int on)
+{
+  disk.intr_on = on;
+  if(disk.event_idx)
+    disk.avail->used_event = on ? intr_target(disk.avail->idx) : disk.used_idx - 1;
+  else if(on)
+    disk.avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+  else
+    disk.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+  __sync_synchronize();
+}
+
+// finish the requests the device has put in the used ring.
+// returns how many there were.
+// caller must hold vdisk_lock.
+static int
+virtio_disk_reap(void)
+{
+  int nreaped = 0;
+
+  while(1){
+    // the device increments disk.used->idx when it
+    // adds an entry to the used ring.
+    while(disk.used_idx != disk.used->idx){
+      __sync_synchronize();
+      int id = disk.used->ring[disk.used_idx % NUM].id;
+
+      if(disk.info[id].status != 0)
+        panic("virtio_disk_intr status");
+
+      // the chain is the header, a descriptor per buf,
+      // and the status.
+      struct buf *bufs[NSG];
+      int n = 0;
+      for(int d = disk.desc[id].next; disk.desc[d].flags & VRING_DESC_F_NEXT; d = disk.desc[d].next){
+        bufs[n++] = disk.info[d].b;
+        disk.info[d].b = 0;
+      }
+      void (*done)(struct buf *) = disk.info[id].done;
+      disk.info[id].done = 0;
+      disk.info[id].wake = 0;
+      free_chain(id);
+
+      for(int i = 0; i < n; i++){
+        struct buf *b = bufs[i];
+        b->disk = 0;   // disk is done with buf
+        if(done)
+          done(b);
+        else
+          wakeup(b);
+      }
+
+      disk.used_idx += 1;
+      nreaped++;
+    }
 
+    // while someone polls, keep interrupts off. otherwise
+    // turn them on, and look again, since the device may
+    // have finished a request before it saw the change.
+    if(disk.npoll > 0){
+      virtio_disk_intr_enable(0);
+      break;
+    }
+    virtio_disk_intr_enable(1);
+    if(disk.used_idx == disk.used->idx)
+      break;
+  }
+  return nreaped;
+}
+
+// wait for b's request by polling the used ring, with
+// interrupts off, for up to POLLSPIN tries, and then by
+// sleeping. for short requests this saves the interrupt
+// and the wakeup.
+static void
+virtio_disk_poll(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  disk.npoll++;
+  virtio_disk_intr_enable(0);
+  for(int i = 0; i < POLLSPIN && b->disk == 1; i++){
+    disk.npolled += virtio_disk_reap();
+    if(b->disk == 1){
+      // let interrupt handlers and submitters in.
+      release(&disk.vdisk_lock);
+      acquire(&disk.vdisk_lock);
+    }
+  }
+  disk.npoll--;
+  disk.npolled += virtio_disk_reap();
+  while(b->disk == 1) {
+    sleep(b, &disk.vdisk_lock);
+  }
   release(&disk.vdisk_lock);
 }
 
@@ -294,22 +524,24 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
-  }
+  disk.nintr++;
+  virtio_disk_reap();
 
   release(&disk.vdisk_lock);
 }
+
+// print request, notification and interrupt counts
+// for the stats device.
+int
+statsdisk(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "--- disk stats\n");
+  n += snprintf(buf+n, sz-n, "%d requests (%d blocks), %d notifies, %d interrupts, %d polled\n",
+                disk.nreq, disk.nblocks, disk.nnotify, disk.nintr, disk.npolled);
+  n += snprintf(buf+n, sz-n, "interrupts per 100 requests: %d, event idx %s\n",
+                disk.nreq ? (int)(disk.nintr * 100 / disk.nreq) : 0,
+                disk.event_idx ? "on" : "off");
+  return n;
+}
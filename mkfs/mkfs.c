@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = NLOG;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -32,6 +32,10 @@ char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
+#define NROOT 1024
+struct dirent rootents[NROOT];
+int nroot;
+
 
 void balloc(int);
 void wsect(uint, void*);
@@ -40,6 +44,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void wdir(uint inum, struct dirent *ents, int n);
 
 // convert to intel byte order
 ushort
@@ -68,16 +73,30 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
+  uint rootino, inum;
   struct dirent de;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc >= 3 && strcmp(argv[1], "-l") == 0){
+    nlog = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+  // journal super block, a descriptor, and a transaction.
+  if(nlog < LOGSIZE+2){
+    fprintf(stderr, "mkfs: log must have at least %d blocks\n", LOGSIZE+2);
+    exit(1);
+  }
+  // the kernel pins a cache buffer for each journaled block.
+  if(nlog > NLOGMAX){
+    fprintf(stderr, "mkfs: log must have at most %d blocks\n", NLOGMAX);
     exit(1);
   }
 
@@ -121,12 +140,12 @@ main(int argc, char *argv[])
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  rootents[nroot++] = de;
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootents[nroot++] = de;
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -155,7 +174,8 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    assert(nroot < NROOT);
+    rootents[nroot++] = de;
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -163,12 +183,7 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  wdir(rootino, rootents, nroot);
 
   balloc(freeblock);
 
@@ -198,6 +213,9 @@ winode(uint inum, struct dinode *ip)
   bn = IBLOCK(inum, sb);
   rsect(bn, buf);
   dip = ((struct dinode*)buf) + (inum % IPB);
+  // the kernel reads a directory's dirfmt as its layout.
+  if(xshort(ip->type) == T_DIR)
+    assert(xshort(ip->dirfmt) == DIRLINEAR || xshort(ip->dirfmt) == DIRHASHED);
   *dip = *ip;
   wsect(bn, buf);
 }
@@ -260,6 +278,115 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Block mapping as in the kernel's bmap(): extents, then the
+// doubly-indirect block.
+uint
+xmap(struct dinode *din, uint fbn)
+{
+  struct extent ext[NXINDIRECT];
+  int i;
+
+  for(i = 0; i < NEXTENT; i++){
+    if(fbn < xint(din->ext[i].len))
+      return xint(din->ext[i].start) + fbn;
+    fbn -= xint(din->ext[i].len);
+  }
+  rsect(xint(din->xaddr), (char*)ext);
+  for(i = 0; i < NXINDIRECT; i++){
+    if(fbn < xint(ext[i].len))
+      return xint(ext[i].start) + fbn;
+    fbn -= xint(ext[i].len);
+  }
+  assert(0);
+  return 0;
+}
+
+int
+xappend(struct dinode *din, uint x)
+{
+  struct extent ext[NXINDIRECT], *e;
+  int i;
+
+  for(i = 0; i < NEXTENT && din->ext[i].len != 0; i++)
+    ;
+  e = 0;
+  if(i > 0 && din->xaddr == 0 &&
+     xint(din->ext[i-1].start) + xint(din->ext[i-1].len) == x){
+    e = &din->ext[i-1];
+  } else if(i < NEXTENT){
+    e = &din->ext[i];
+    e->start = xint(x);
+  }
+  if(e){
+    e->len = xint(xint(e->len) + 1);
+    din->xblocks = xint(xint(din->xblocks) + 1);
+    return 1;
+  }
+
+  if(din->xaddr == 0){
+    din->xaddr = xint(freeblock++);
+    bzero(ext, sizeof(ext));
+    wsect(xint(din->xaddr), (char*)ext);
+  }
+  rsect(xint(din->xaddr), (char*)ext);
+  for(i = 0; i < NXINDIRECT && ext[i].len != 0; i++)
+    ;
+  if(i > 0 && xint(ext[i-1].start) + xint(ext[i-1].len) == x){
+    e = &ext[i-1];
+  } else if(i < NXINDIRECT){
+    e = &ext[i];
+    e->start = xint(x);
+  } else {
+    return 0;
+  }
+  e->len = xint(xint(e->len) + 1);
+  wsect(xint(din->xaddr), (char*)ext);
+  din->xblocks = xint(xint(din->xblocks) + 1);
+  return 1;
+}
+
+uint
+dmap(struct dinode *din, uint fbn, uint x)
+{
+  uint dind[NINDIRECT], ind[NINDIRECT];
+
+  if(din->daddr == 0){
+    din->daddr = xint(freeblock++);
+    bzero(dind, sizeof(dind));
+    wsect(xint(din->daddr), (char*)dind);
+  }
+  rsect(xint(din->daddr), (char*)dind);
+  if(dind[fbn / NINDIRECT] == 0){
+    dind[fbn / NINDIRECT] = xint(freeblock++);
+    wsect(xint(din->daddr), (char*)dind);
+    bzero(ind, sizeof(ind));
+    wsect(xint(dind[fbn / NINDIRECT]), (char*)ind);
+  }
+  rsect(xint(dind[fbn / NINDIRECT]), (char*)ind);
+  if(ind[fbn % NINDIRECT] == 0){
+    ind[fbn % NINDIRECT] = xint(x ? x : freeblock++);
+    wsect(xint(dind[fbn / NINDIRECT]), (char*)ind);
+  }
+  return xint(ind[fbn % NINDIRECT]);
+}
+
+uint
+bmap(struct dinode *din, uint fbn)
+{
+  uint x;
+
+  assert(fbn < MAXFILE);
+  if(fbn < xint(din->xblocks))
+    return xmap(din, fbn);
+  x = 0;
+  if(din->daddr == 0){
+    x = freeblock++;
+    if(xappend(din, x))
+      return x;
+  }
+  return dmap(din, fbn - xint(din->xblocks), x);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -267,7 +394,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -275,23 +401,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -303,3 +413,73 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Same as dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261U;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Write the n entries in ents[] to directory inum: as one
+// block if they fit, otherwise hashed, with all the leaves at
+// the smallest depth at which none overflows.
+void
+wdir(uint inum, struct dirent *ents, int n)
+{
+  uchar blk[BSIZE];
+  struct dirent *de;
+  struct dinode din;
+  int depth, i, j, k, max, cnt;
+
+  if(n <= DPB){
+    bzero(blk, sizeof(blk));
+    memmove(blk, ents, n * sizeof(*ents));
+    iappend(inum, blk, BSIZE);
+    rinode(inum, &din);
+    assert(xshort(din.dirfmt) == DIRLINEAR);
+    return;
+  }
+
+  for(depth = 0; ; depth++){
+    assert(depth <= DIRMAXDEPTH);
+    max = 0;
+    for(k = 0; k < (1 << depth); k++){
+      cnt = 0;
+      for(i = 0; i < n; i++)
+        if((dirhash(ents[i].name) & ((1 << depth) - 1)) == k)
+          cnt++;
+      if(cnt > max)
+        max = cnt;
+    }
+    if(max < DPB)
+      break;
+  }
+
+  bzero(blk, sizeof(blk));
+  DDEPTH(blk) = depth;
+  for(k = 0; k < (1 << depth); k++)
+    DINDEX(blk, k) = xshort(1 + k);
+  iappend(inum, blk, BSIZE);
+
+  for(k = 0; k < (1 << depth); k++){
+    bzero(blk, sizeof(blk));
+    DDEPTH(blk) = depth;
+    de = (struct dirent*)blk;
+    j = 1;
+    for(i = 0; i < n; i++)
+      if((dirhash(ents[i].name) & ((1 << depth) - 1)) == k)
+        de[j++] = ents[i];
+    iappend(inum, blk, BSIZE);
+  }
+
+  rinode(inum, &din);
+  din.dirfmt = xshort(DIRHASHED);
+  winode(inum, &din);
+}
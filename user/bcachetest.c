@@ -8,6 +8,7 @@
 
 void test0();
 void test1();
+void test2();
 
 #define SZ 4096
 char buf[SZ];
@@ -17,6 +18,7 @@ main(int argc, char *argv[])
 {
   test0();
   test1();
+  test2();
   exit(0);
 }
 
@@ -185,3 +187,65 @@ void test1()
   }
   printf("test1 OK\n");
 }
+
+// Repeatedly read a file larger than the buffer cache's initial
+// size, so that blocks miss and bget() must grow the cache or
+// find a victim, and check that every block reads back with what
+// was written. Reports the elapsed ticks, to compare eviction
+// strategies.
+void test2()
+{
+  char file[] = "M";
+  enum { N = 20, BIG = 256 };
+  char buf[BSIZE];
+  struct stat st;
+  int fd, start, ticks;
+
+  printf("start test2\n");
+  unlink(file);
+  fd = open(file, O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("test2: create %s failed\n", file);
+    exit(-1);
+  }
+  for(int b = 0; b < BIG; b++){
+    memset(buf, b, sizeof(buf));
+    ((int*)buf)[0] = b;
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("test2: write %s failed\n", file);
+      exit(-1);
+    }
+  }
+  close(fd);
+
+  start = uptime();
+  for(int i = 0; i < N; i++){
+    if((fd = open(file, O_RDONLY)) < 0){
+      printf("test2: open %s failed\n", file);
+      exit(-1);
+    }
+    if(fstat(fd, &st) < 0 || st.size != BIG*BSIZE){
+      printf("test2: %s has size %d, not %d\n", file, st.size, BIG*BSIZE);
+      printf("test2: FAIL\n");
+      exit(-1);
+    }
+    for(int b = 0; b < BIG; b++){
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+        printf("test2: read %s failed\n", file);
+        exit(-1);
+      }
+      for(int j = sizeof(int); j < BSIZE; j++){
+        if(((int*)buf)[0] != b || buf[j] != (char)b){
+          printf("test2: block %d reads back wrong\n", b);
+          printf("test2: FAIL\n");
+          exit(-1);
+        }
+      }
+    }
+    close(fd);
+  }
+  ticks = uptime() - start;
+  unlink(file);
+  printf("test2: %d block reads in %d ticks\n", N*BIG, ticks);
+  printf("test2: OK\n");
+}